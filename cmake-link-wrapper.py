@@ -3,10 +3,9 @@
 import sys
 import subprocess
 
-prelink_args = ["mk-weakfunc-elf", "-w"]
+# object files are passed on stdin so long links do not hit ARG_MAX
+prelink_args = ["mk-weakfunc-elf", "-w", "--files-from=-"]
 objfiles = [arg for arg in sys.argv[2:] if arg[-2:] == ".o"]
 
-subprocess.run(prelink_args + objfiles)
+subprocess.run(prelink_args, input="".join(f + "\0" for f in objfiles).encode())
 subprocess.run(sys.argv[1:])
-
-
@@ -10,53 +10,167 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
 #include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <mutex>
+#include <cerrno>
+#include <climits>
+#include <unordered_map>
+#include <string_view>
+#include <numeric>
+#include <fnmatch.h>
+#include <set>
+#include <sys/inotify.h>
+#include <dirent.h>
 
 using namespace std;
 
 // These are used for displaying field names
 map<int, string> stt_name;
 map<int, string> stb_name;
+map<int, string> stv_name;
 map<int, string> sht_name;
 
-tuple<void*, size_t> memory_map_file(string& file);
-unsigned char verify_elf(void* hdr);
+// Not defined by all versions of elf.h
+#ifndef SHT_LLVM_ADDRSIG
+#define SHT_LLVM_ADDRSIG 0x6fff4c03
+#endif
 
-template<typename ElfNN_Ehdr, typename ElfNN_Shdr, typename ElfNN_Sym>
-void process_files(vector<string>& infiles, vector<string>& dupfiles, vector<string>& funclist,
-		   string& section_name, bool write_flag);
+tuple<void*, size_t> memory_map_file(string& file, bool writable = true);
+tuple<void*, size_t> memory_map_fd(int fd, string& name, bool writable);
+unsigned char verify_elf(void* hdr, string& filename);
 
 /*
- * Sets the BIND attribute in the symbol table to WEAK for functions
- * in the function_names list.
+ * Logging.  Messages are collected in a buffer and written to stderr
+ * a block at a time instead of a line at a time.  The level is tested
+ * before a message is formatted so suppressed messages cost nothing.
+ * Errors are written out straight away.
  */
-template <typename ElfNN_Sym>
-void patch_file(ElfNN_Sym *shdr, char* symbuf, vector<string>& function_names);
+enum {
+  LEVEL_ERROR,			// -q
+  LEVEL_INFO,			// default
+  LEVEL_VERBOSE,		// -v
+};
+
+int log_level = LEVEL_INFO;
+
+void log_write(int level, const string& msg);
+void log_flush();
+string errno_string();
+
+#define LOG(level, msg)				\
+  do {						\
+    if (log_level >= (level)) {			\
+      ostringstream log_stream;			\
+      log_stream << msg << '\n';		\
+      log_write((level), log_stream.str());	\
+    }						\
+  } while (0)
+
+#define LOG_ERROR(msg)   LOG(LEVEL_ERROR, "error: " << msg)
+#define LOG_INFO(msg)    LOG(LEVEL_INFO, msg)
+#define LOG_VERBOSE(msg) LOG(LEVEL_VERBOSE, msg)
+
+// Replaces perror()
+#define LOG_ERRNO(what)  LOG_ERROR(what << ": " << errno_string())
+
+class SymbolRules;
+
+bool process_files(vector<string>& infiles, vector<string>& dupfiles, vector<string>& funclist,
+		   SymbolRules& rules, string& prefix_name, string& section_name, bool write_flag,
+		   istream* files_from = nullptr);
+
+/*
+ * Compile time description of one Elf class and byte order.  Every
+ * scan and patch kernel is instantiated once for each of these so a
+ * file is processed without testing its format symbol by symbol.
+ * Fields read from the file go through get() which byte swaps them
+ * only when the file and host byte orders differ.
+ */
+template<typename ElfNN_Ehdr, typename ElfNN_Shdr, typename ElfNN_Sym,
+	 typename ElfNN_Rel, typename ElfNN_Rela, int ElfNN_Data>
+struct ElfTraits {
+  typedef ElfNN_Ehdr Ehdr;
+  typedef ElfNN_Shdr Shdr;
+  typedef ElfNN_Sym  Sym;
+  typedef ElfNN_Rel  Rel;
+  typedef ElfNN_Rela Rela;
+  typedef decltype(ElfNN_Rel::r_info) Rinfo;
+
+  static constexpr bool swapped =
+    (ElfNN_Data == ELFDATA2LSB) != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+  template<typename T>
+  static T get(T value) {
+    if constexpr (!swapped || sizeof(T) == 1)
+      return value;
+    else if constexpr (sizeof(T) == 2)
+      return (T)__builtin_bswap16(value);
+    else if constexpr (sizeof(T) == 4)
+      return (T)__builtin_bswap32(value);
+    else
+      return (T)__builtin_bswap64(value);
+  }
+
+  // Converts a host value for storing in the file
+  template<typename T>
+  static T put(T value) { return get(value); }
+
+  // The symbol index part of a relocation's r_info
+  static size_t r_sym(Rinfo info) {
+    if constexpr (sizeof(Rinfo) == 8)
+      return ELF64_R_SYM(info);
+    else
+      return ELF32_R_SYM(info);
+  }
+
+  // Replaces the symbol index part of r_info
+  static Rinfo r_info(size_t sym, Rinfo info) {
+    if constexpr (sizeof(Rinfo) == 8)
+      return ELF64_R_INFO(sym, ELF64_R_TYPE(info));
+    else
+      return ELF32_R_INFO(sym, ELF32_R_TYPE(info));
+  }
+};
+
+typedef ElfTraits<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym, Elf32_Rel, Elf32_Rela, ELFDATA2LSB> Elf32LSB;
+typedef ElfTraits<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym, Elf32_Rel, Elf32_Rela, ELFDATA2MSB> Elf32MSB;
+typedef ElfTraits<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym, Elf64_Rel, Elf64_Rela, ELFDATA2LSB> Elf64LSB;
+typedef ElfTraits<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym, Elf64_Rel, Elf64_Rela, ELFDATA2MSB> Elf64MSB;
+
+/*
+ * Applies the binding and visibility rules matching the symbol's name.
+ * Returns true if the symbol was changed.
+ */
+template <typename Elf>
+bool patch_file(typename Elf::Sym *shdr, char* symbuf, SymbolRules& rules);
 
 
 template <typename ElfNN_Ehdr>
 class ElfFile {
 public:
-  ElfFile(string& _filename) {
-    init(_filename);
+  ElfFile(string& _filename, bool writable = true) {
+    init(_filename, writable);
   }
 
   ~ElfFile() {
     deinit();
   }
 
-  void init(string& _filename) {
+  void init(string& _filename, bool writable = true) {
     filename = _filename;
-    auto [_ehdr, _size] = memory_map_file(filename);
+    auto [_ehdr, _size] = memory_map_file(filename, writable);
     ehdr = (ElfNN_Ehdr*)_ehdr;
     size = _size;
-    if (!verify_elf(ehdr)) {
-      cout << "error: invalid elf file " << filename << endl;
+    if (!verify_elf(ehdr, filename))
       deinit();
-    }
   }
 
   char check_arch() {
@@ -66,7 +180,7 @@ public:
   void deinit() {
     if (ehdr) {
       if (munmap(ehdr, size) < 0) {
-	perror("munmap");
+	LOG_ERRNO(filename << ": munmap");
       }
       ehdr = nullptr;
       size = 0;
@@ -84,6 +198,357 @@ public:
 
 };
 
+/*
+ * Holds an exclusive advisory lock on a file for the lifetime of the
+ * object.  Concurrent invocations patching the same object file are
+ * serialized through this lock.
+ */
+class FileLock {
+public:
+  FileLock(string& filename) {
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    if (flock(fd, LOCK_EX) < 0) {
+      LOG_ERRNO(filename << ": flock");
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  ~FileLock() {
+    if (fd >= 0)
+      close(fd);		// also releases the lock
+  }
+
+private:
+  int fd;
+};
+
+/*
+ * Shared record of the object files already patched by this or any
+ * concurrent invocation.  The state file is append-only, one line per
+ * patched file:
+ *
+ *   DEV INO SIZE MTIME_SEC MTIME_NSEC DIGEST PATH
+ *
+ * where DIGEST identifies the test double set the file was patched
+ * against.  Later lines override earlier ones.  An entry only counts
+ * while the file's inode, size and mtime are unchanged, so rebuilt
+ * objects are always patched again.  The file may be deleted at any
+ * time.
+ */
+class PatchState {
+public:
+  PatchState() : fd(-1), loaded_size(0) {}
+
+  ~PatchState() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool open(const string& filename) {
+    fd = ::open(filename.c_str(), O_RDWR|O_CREAT|O_APPEND, 0666);
+    if (fd < 0) {
+      LOG_ERRNO(filename);
+      return false;
+    }
+    return true;
+  }
+
+  bool enabled() { return fd >= 0; }
+
+  /*
+   * True if filename was patched against digest and is unchanged
+   * since then.
+   */
+  bool is_current(string& filename, uint64_t digest) {
+    if (!enabled())
+      return false;
+
+    struct stat statbuf;
+    if (stat(filename.c_str(), &statbuf))
+      return false;
+
+    refresh();
+    auto p = entries.find({statbuf.st_dev, statbuf.st_ino});
+    if (p == entries.end())
+      return false;
+
+    auto& e = p->second;
+    return e.digest == digest && e.size == statbuf.st_size &&
+      e.mtime_sec == statbuf.st_mtim.tv_sec &&
+      e.mtime_nsec == statbuf.st_mtim.tv_nsec;
+  }
+
+  void record(string& filename, uint64_t digest) {
+    if (!enabled())
+      return;
+
+    struct stat statbuf;
+    if (stat(filename.c_str(), &statbuf))
+      return;
+
+    ostringstream line;
+    line << statbuf.st_dev << ' ' << statbuf.st_ino << ' ' << statbuf.st_size << ' ' <<
+      statbuf.st_mtim.tv_sec << ' ' << statbuf.st_mtim.tv_nsec << ' ' << digest << ' ' <<
+      filename << '\n';
+    string s = line.str();
+
+    // a single O_APPEND write keeps concurrent records from interleaving
+    flock(fd, LOCK_EX);
+    if (write(fd, s.data(), s.size()) != (ssize_t)s.size())
+      LOG_ERRNO("state file: write");
+    flock(fd, LOCK_UN);
+  }
+
+private:
+  struct Entry {
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    uint64_t digest;
+  };
+
+  /*
+   * Reads any records appended since the last call.
+   */
+  void refresh() {
+    flock(fd, LOCK_SH);
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == 0 && statbuf.st_size > loaded_size) {
+      string buf(statbuf.st_size - loaded_size, '\0');
+      ssize_t n = pread(fd, buf.data(), buf.size(), loaded_size);
+      if (n > 0) {
+	// only consume complete lines
+	auto end = buf.rfind('\n', n - 1);
+	if (end != string::npos) {
+	  parse(buf.substr(0, end + 1));
+	  loaded_size += end + 1;
+	}
+      }
+    }
+    flock(fd, LOCK_UN);
+  }
+
+  void parse(string buf) {
+    istringstream in(buf);
+    string line;
+    while (getline(in, line)) {
+      istringstream fields(line);
+      dev_t dev;
+      ino_t ino;
+      Entry e;
+      if (fields >> dev >> ino >> e.size >> e.mtime_sec >> e.mtime_nsec >> e.digest)
+	entries[{dev, ino}] = e;
+    }
+  }
+
+  int fd;
+  off_t loaded_size;
+  map<pair<dev_t, ino_t>, Entry> entries;
+};
+
+// Shared with concurrent invocations when --state-file is given
+PatchState patch_state;
+
+/*
+ * 64 bit FNV-1a hash of len bytes, continuing from hash.
+ */
+uint64_t fnv1a(const void* ptr, size_t len, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+  auto bytes = (const unsigned char*)ptr;
+  for (size_t n = 0; n < len; n++) {
+    hash ^= bytes[n];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Allows looking up string keys with a string_view
+struct string_hash {
+  using is_transparent = void;
+  size_t operator()(string_view s) const { return hash<string_view>{}(s); }
+};
+
+/*
+ * Symbol binding and visibility rules.  A rules file has one rule per
+ * line: a symbol name, or an fnmatch(3) pattern, followed by one or
+ * more operations:
+ *
+ *   weaken              GLOBAL => WEAK
+ *   localize            GLOBAL or WEAK => LOCAL (defined symbols only)
+ *   globalize           LOCAL => GLOBAL (defined symbols only)
+ *   hide                same as visibility=hidden
+ *   visibility=VIS      VIS is one of default, internal, hidden or protected
+ *
+ * for example
+ *
+ *   # symbol     operations
+ *   func         weaken
+ *   helper_*     localize hide
+ *
+ * Blank lines and lines starting with '#' are ignored.  When several
+ * rules match a symbol the later one wins.  Test double functions are
+ * added as weaken rules which only apply to STT_FUNC symbols, and
+ * removed again with globalize rules which turn those WEAK functions
+ * back to GLOBAL.
+ */
+class SymbolRules {
+public:
+  struct Action {
+    int bind;			// STB_* to set or -1
+    int visibility;		// STV_* to set or -1
+    bool func_only;		// bind only applies to functions
+  };
+
+  bool read(string& filename) {
+    ifstream in(filename);
+    if (!in) {
+      LOG_ERROR("unable to read rules " << filename);
+      return false;
+    }
+
+    string line;
+    for (int lineno = 1; getline(in, line); lineno++) {
+      istringstream fields(line);
+      string pattern;
+      if (!(fields >> pattern) || pattern[0] == '#')
+	continue;
+
+      Action action = {-1, -1, false};
+      string op;
+      while (fields >> op) {
+	if (!parse_operation(op, action)) {
+	  LOG_ERROR(filename << ":" << lineno << ": unknown operation " << op);
+	  return false;
+	}
+      }
+      if (action.bind < 0 && action.visibility < 0) {
+	LOG_ERROR(filename << ":" << lineno << ": no operation for " << pattern);
+	return false;
+      }
+      add(pattern, action);
+    }
+    return true;
+  }
+
+  void add(const string& pattern, Action action) {
+    if (pattern.find_first_of("*?[") == string::npos)
+      exact[pattern].push_back(rules.size());
+    else
+      patterns.push_back(rules.size());
+    rules.push_back({pattern, action});
+  }
+
+  /*
+   * The test double functions are sorted so equivalent sets give the
+   * same digest().
+   */
+  void add_test_doubles(vector<string>& function_names) {
+    vector<string> names(function_names);
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+    for (auto p = names.begin(); p != names.end(); p++)
+      add(*p, {STB_WEAK, -1, true});
+  }
+
+  /*
+   * Undoes add_test_doubles() for functions which no longer have a
+   * test double.  Only name functions known to have been GLOBAL, the
+   * rule would also promote functions declared weak in the source.
+   */
+  void add_restored_doubles(vector<string>& function_names) {
+    for (auto p = function_names.begin(); p != function_names.end(); p++)
+      add(*p, {STB_GLOBAL, -1, true});
+  }
+
+  bool empty() { return rules.empty(); }
+
+  /*
+   * Combines the actions of all rules matching name.  Returns false if
+   * there are none.
+   */
+  bool match(const char* name, Action& action) {
+    static const vector<size_t> none;
+    auto p = exact.find(string_view(name));
+    auto& named = (p != exact.end()) ? p->second : none;
+    if (named.empty() && patterns.empty())
+      return false;
+
+    // Both index lists are ascending, merge them to keep rule order
+    bool found = false;
+    action = {-1, -1, false};
+    auto n = named.begin();
+    auto q = patterns.begin();
+    while (n != named.end() || q != patterns.end()) {
+      size_t idx;
+      if (q == patterns.end() || (n != named.end() && *n < *q)) {
+	idx = *n++;
+      } else {
+	idx = *q++;
+	if (fnmatch(rules[idx].pattern.c_str(), name, 0) != 0)
+	  continue;
+      }
+
+      auto& a = rules[idx].action;
+      if (a.bind >= 0) {
+	action.bind = a.bind;
+	action.func_only = a.func_only;
+      }
+      if (a.visibility >= 0)
+	action.visibility = a.visibility;
+      found = true;
+    }
+    return found;
+  }
+
+  /*
+   * Hash of the rules, used to tell whether two invocations patch
+   * against an equivalent set.
+   */
+  uint64_t digest() {
+    uint64_t hash = fnv1a(nullptr, 0);
+    for (auto p = rules.begin(); p != rules.end(); p++) {
+      int fields[] = {p->action.bind, p->action.visibility, p->action.func_only};
+      hash = fnv1a(p->pattern.c_str(), p->pattern.size() + 1, hash);
+      hash = fnv1a(fields, sizeof(fields), hash);
+    }
+    return hash;
+  }
+
+private:
+  static bool parse_operation(string& op, Action& action) {
+    static const map<string, int> visibilities = {
+      {"default", STV_DEFAULT}, {"internal", STV_INTERNAL},
+      {"hidden", STV_HIDDEN}, {"protected", STV_PROTECTED},
+    };
+
+    if (op == "weaken")
+      action.bind = STB_WEAK;
+    else if (op == "localize")
+      action.bind = STB_LOCAL;
+    else if (op == "globalize")
+      action.bind = STB_GLOBAL;
+    else if (op == "hide")
+      action.visibility = STV_HIDDEN;
+    else if (op.substr(0, 11) == "visibility=" && visibilities.count(op.substr(11)))
+      action.visibility = visibilities.at(op.substr(11));
+    else
+      return false;
+    return true;
+  }
+
+  struct Rule {
+    string pattern;
+    Action action;
+  };
+
+  vector<Rule> rules;
+  unordered_map<string, vector<size_t>, string_hash, equal_to<>> exact;
+  vector<size_t> patterns;
+};
+
 static string basename(string& argv0)
 {
   int npos = 0;
@@ -105,8 +570,8 @@ void usage(string argv0)
     "object files containing duplicated functions.  The purpose is to enable building test cases\n" <<
     "using test doubles (mocks, stubs, etc.) without having to modify the original sources.\n" <<
     "Supports both Elf32 and Elf64 formats and has been tested on X86_64 and ARM processors.\n\n" <<
-    "OBJFILES                              List of either Elf32 or Elf64 relocatable object files to\n" <<
-    "                                      be optionally modified.\n" <<
+    "OBJFILES                              List of Elf32 or Elf64, little or big-endian relocatable\n" <<
+    "                                      object files, in any mix, to be optionally modified.\n" <<
     "\nOPTIONS:\n" <<
     " -s --section-name=SECTION_NAME       Defines an alternate Elf text section (default .mock)\n" <<
     "                                      in which test double functions will have been placed.\n" <<
@@ -119,6 +584,38 @@ void usage(string argv0)
     "                                      in OBJFILES: excluding those with a text section\n" <<
     "                                      labeled SECTION_NAME.\n" <<
     " -l --list                            List function test doubles.\n" <<
+    " -q --quiet                           Only report errors.\n" <<
+    " -v --verbose                         Also report each change made to OBJFILES.\n" <<
+    "    --manifest=MANIFEST_FILE          Reads test double function names, one per line, from\n" <<
+    "                                      MANIFEST_FILE.  Option may be invoked multiple times.\n" <<
+    "    --write-manifest=MANIFEST_FILE    Saves the collected test double function names to\n" <<
+    "                                      MANIFEST_FILE for use with --manifest.\n" <<
+    "    --rules=RULES_FILE                With -w also applies the symbol binding and visibility\n" <<
+    "                                      rules in RULES_FILE (weaken, localize, globalize, hide,\n" <<
+    "                                      visibility=VIS) in the same pass, to test double files\n" <<
+    "                                      too.  Option may be invoked multiple times.\n" <<
+    "    --state-file=STATE_FILE           Shares the list of already patched files with concurrent\n" <<
+    "                                      invocations so each file is only patched once.\n" <<
+    "    --plan=PLAN_FILE                  Instead of modifying OBJFILES, saves the changes -w would\n" <<
+    "                                      make to PLAN_FILE.\n" <<
+    "    --apply=PLAN_FILE                 Makes the changes saved in PLAN_FILE.  Files which have\n" <<
+    "                                      changed since the plan was made are not modified.\n" <<
+    "    --compile-wrap -- COMMAND...      Runs the compiler COMMAND and then sets WEAK binding\n" <<
+    "                                      for the test double functions in the object file(s)\n" <<
+    "                                      it produced.  No other object files are touched.\n" <<
+    "    --watch=DIR                       Keeps running and sets WEAK binding in the object files\n" <<
+    "                                      written to DIR as they appear, re-patching objects\n" <<
+    "                                      whenever a test double is added or removed.  Option\n" <<
+    "                                      may be invoked multiple times.\n" <<
+    "    --files-from=FILE                 Also reads OBJFILES from FILE, '-' for stdin, separated\n" <<
+    "                                      by NUL or newline characters.  Each file is scanned as\n" <<
+    "                                      soon as its name is read.\n" <<
+    "    --filter[=FD]                     Reads one object file from stdin, or the inherited file\n" <<
+    "                                      descriptor FD, sets WEAK binding for the test double\n" <<
+    "                                      functions and writes it to stdout.  Labeled test\n" <<
+    "                                      doubles only get the --rules.\n" <<
+    "    @FILE                             Reads further arguments, separated by white space, from\n" <<
+    "                                      the response file FILE.\n" <<
     " -h --help                            This help.\n\n";
 }
 
@@ -145,31 +642,83 @@ static void init_tables()
   stb_name[STB_LOCAL]     = "LOCAL";
   stb_name[STB_GLOBAL]    = "GLOBAL";
   stb_name[STB_WEAK]      = "WEAK";
+
+  stv_name[STV_DEFAULT]   = "DEFAULT";
+  stv_name[STV_INTERNAL]  = "INTERNAL";
+  stv_name[STV_HIDDEN]    = "HIDDEN";
+  stv_name[STV_PROTECTED] = "PROTECTED";
+}
+
+static mutex log_mutex;
+static string log_buffer;
+static const size_t LOG_BUFFER_SIZE = 64 * 1024;
+
+static void log_flush_locked()
+{
+  const char* p = log_buffer.data();
+  size_t len = log_buffer.size();
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    p += n;
+    len -= n;
+  }
+  log_buffer.clear();
+}
+
+/*
+ * Appends a formatted message to the log buffer.  Safe to call from
+ * multiple threads.
+ */
+void log_write(int level, const string& msg)
+{
+  lock_guard<mutex> guard(log_mutex);
+  log_buffer += msg;
+  if (level == LEVEL_ERROR || log_buffer.size() >= LOG_BUFFER_SIZE)
+    log_flush_locked();
+}
+
+void log_flush()
+{
+  lock_guard<mutex> guard(log_mutex);
+  log_flush_locked();
+}
+
+/*
+ * Thread safe strerror(errno).
+ */
+string errno_string()
+{
+  char buf[128];
+  return strerror_r(errno, buf, sizeof(buf));
 }
 
 /*
  * Returns a pointer to the start of the section header table.
  */
-template <typename ElfNN_Shdr, typename ElfNN_Ehdr>
-ElfNN_Shdr* get_section_header(ElfNN_Ehdr* ehdr)
+template <typename Elf>
+typename Elf::Shdr* get_section_header(typename Elf::Ehdr* ehdr)
 {
   char* buffer = (char*)ehdr;
-  return (ElfNN_Shdr*)(buffer + ehdr->e_shoff);
+  return (typename Elf::Shdr*)(buffer + Elf::get(ehdr->e_shoff));
 }
 
 /*
  * Finds the start of the symbol table and returns a tuple of the
  * pointer to the first byte of the table and the number of entries.
  */
-template <typename ElfNN_Shdr, typename ElfNN_Sym, typename ElfNN_Ehdr>
-tuple<ElfNN_Sym*, int> get_symbol_table(ElfNN_Ehdr* ehdr)
+template <typename Elf>
+tuple<typename Elf::Sym*, int> get_symbol_table(typename Elf::Ehdr* ehdr)
 {
   char* buffer = (char*)ehdr;
-  auto shdr = get_section_header<ElfNN_Shdr>(ehdr);
-  for (int secno = 0; secno < ehdr->e_shnum; secno++, shdr++) {
-    if (shdr->sh_type == SHT_SYMTAB) {
-      int nsyms = shdr->sh_size / shdr->sh_entsize;
-      return {(ElfNN_Sym*)(buffer + shdr->sh_offset), nsyms};
+  auto shdr = get_section_header<Elf>(ehdr);
+  for (int secno = 0; secno < Elf::get(ehdr->e_shnum); secno++, shdr++) {
+    if (Elf::get(shdr->sh_type) == SHT_SYMTAB) {
+      int nsyms = Elf::get(shdr->sh_size) / Elf::get(shdr->sh_entsize);
+      return {(typename Elf::Sym*)(buffer + Elf::get(shdr->sh_offset)), nsyms};
     }
   }
   return {nullptr, 0};
@@ -180,19 +729,19 @@ tuple<ElfNN_Sym*, int> get_symbol_table(ElfNN_Ehdr* ehdr)
  * section header string buffers, respectively. For LLVM at least, the
  * two pointers will be the same.
  */
-template<typename ElfNN_Shdr, typename ElfNN_Ehdr>
-tuple<char*, char*> get_string_buffers(ElfNN_Ehdr* ehdr)
+template<typename Elf>
+tuple<char*, char*> get_string_buffers(typename Elf::Ehdr* ehdr)
 {
   char* ebuf = (char*)ehdr;
   char* symbuf = nullptr;
   char* shbuf = nullptr;
-  ElfNN_Shdr* shdr = (ElfNN_Shdr*)(ebuf + ehdr->e_shoff);
-  for (int secno = 0; secno < ehdr->e_shnum; secno++, shdr++) {
-    if (shdr->sh_type == SHT_STRTAB) {
-      if (secno == ehdr->e_shstrndx) {
-	shbuf = (char*)(ebuf + shdr->sh_offset);
+  auto shdr = get_section_header<Elf>(ehdr);
+  for (int secno = 0; secno < Elf::get(ehdr->e_shnum); secno++, shdr++) {
+    if (Elf::get(shdr->sh_type) == SHT_STRTAB) {
+      if (secno == Elf::get(ehdr->e_shstrndx)) {
+	shbuf = (char*)(ebuf + Elf::get(shdr->sh_offset));
       } else {
-	symbuf = (char*)(ebuf + shdr->sh_offset);
+	symbuf = (char*)(ebuf + Elf::get(shdr->sh_offset));
       }
     }
   }
@@ -231,36 +780,43 @@ bool file_has_select_prefix(string& filename, string& prefix)
 }
 
 /**
- * Check if input ptr references a valid elf file.  Returns either
- * ELFCLASS32 or ELFCLASS64 on sucess or ELFCLASSNONE on failure.
+ * Check if input ptr references a valid elf file of either byte
+ * order.  Returns either ELFCLASS32 or ELFCLASS64 on sucess or
+ * ELFCLASSNONE on failure.  filename is only used in error messages.
  */
-unsigned char verify_elf(void* ptr)
+unsigned char verify_elf(void* ptr, string& filename)
 {
   unsigned char ei_class = ELFCLASSNONE;
 
   if (ptr == nullptr) {
-    printf("error: no file found\n");
+    LOG_ERROR(filename << ": no file found");
     return ei_class;
   }
 
   auto hdr = (Elf64_Ehdr*)ptr;
 
-  if (hdr->e_ident[EI_MAG0] != ELFMAG0 &&
-      hdr->e_ident[EI_MAG1] != ELFMAG1 &&
-      hdr->e_ident[EI_MAG2] != ELFMAG2 &&
-      hdr->e_ident[EI_MAG3] != ELFMAG3) {
-    cout << "error: Elf magic number not found\n";
+  if (memcmp(hdr->e_ident, ELFMAG, SELFMAG) != 0) {
+    LOG_ERROR(filename << ": Elf magic number not found");
     return ei_class;
   }
 
-  if (hdr->e_ident[EI_DATA] != ELFDATA2LSB) {
-    cout << "error: file must be 2's complement, little-endian\n";
+  // e_type is at the same offset in both classes
+  auto e_type = hdr->e_type;
+  switch (hdr->e_ident[EI_DATA]) {
+  case ELFDATA2LSB:
+    e_type = Elf64LSB::get(e_type);
+    break;
+  case ELFDATA2MSB:
+    e_type = Elf64MSB::get(e_type);
+    break;
+  default:
+    LOG_ERROR(filename << ": file must be 2's complement, little or big-endian");
     return ei_class;
   }
 
   // Relocatable object?
-  if (hdr->e_type != ET_REL) {
-    cout << "error: file must be relocatable object\n";
+  if (e_type != ET_REL) {
+    LOG_ERROR(filename << ": file must be relocatable object");
     return ei_class;
   }
 
@@ -268,59 +824,63 @@ unsigned char verify_elf(void* ptr)
   ei_class = hdr->e_ident[EI_CLASS];
   if ((ei_class != ELFCLASS32) &&
       (ei_class != ELFCLASS64)) {
-    cout << "error: only Elf32 and Elf64 architectures supported\n";
+    LOG_ERROR(filename << ": only Elf32 and Elf64 architectures supported");
     return ei_class;
   }
 
   return ei_class;
 }
 
-/*
- * Determines if the file is ELFCLASS32, ELFCLASS64 or ELFCLASSNONE
- * (none of the above) and returns one of these values.
- *
- * At this point the choice of Elf header structure type doesn't
- * matter, that is, either the 32 or 64 bit version will work since
- * only the commen part of the header is being examined.
- */
-char check_arch(string& filename)
-{
-  ElfFile<Elf64_Ehdr> elfFile(filename);
-  return elfFile.check_arch();
-}
-
 /*
  * Memory map in the file.  Returns a tuple of a pointer to the start
- * of the file and the size of the file.
+ * of the file and the size of the file.  Unless writable is set the
+ * mapping is a private copy: it may still be modified in memory but
+ * the changes never reach the file.
  */
-tuple<void*, size_t> memory_map_file(string& file)
+tuple<void*, size_t> memory_map_file(string& file, bool writable)
 {
   if (file.size() == 0)
     return {nullptr, 0};
 
-  int fd = open(file.c_str(), O_RDWR);
+  int fd = open(file.c_str(), writable ? O_RDWR : O_RDONLY);
   if (fd < 0) {
-    perror("open");
+    LOG_ERRNO(file);
     return {nullptr, 0};
   }
 
+  auto mapping = memory_map_fd(fd, file, writable);
+
+  /*
+   * No longer need to leave the file open once the it is mapped in.
+   */
+  close(fd);
+
+  return mapping;
+}
+
+/*
+ * As memory_map_file() for an open file descriptor.  name is only used
+ * in error messages.
+ */
+tuple<void*, size_t> memory_map_fd(int fd, string& name, bool writable)
+{
   struct stat statbuf;
   if (fstat(fd, &statbuf)) {
-    perror("stat");
+    LOG_ERRNO(name << ": stat");
+    return {nullptr, 0};
+  }
+  if (statbuf.st_size == 0) {
+    LOG_ERROR(name << ": empty file");
     return {nullptr, 0};
   }
 
-  auto ptr = mmap(NULL, statbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  auto ptr = mmap(NULL, statbuf.st_size, PROT_READ|PROT_WRITE,
+		  writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
   if (ptr == MAP_FAILED || ptr == nullptr) {
-    perror("mmap");
+    LOG_ERRNO(name << ": mmap");
     return {nullptr, 0};
   }
 
-  /*
-   * No longer need to leave the file open once the it is mapped in.
-   */
-  close(fd);
-
   return {ptr, statbuf.st_size};
 }
 
@@ -350,21 +910,21 @@ inline bool check_symbol_type(Elf32_Sym* sym) {
  * Returns the index in the Elf Section header table whose names
  * matches section_name.
  */
-template<typename ElfNN_Shdr, typename ElfNN_Ehdr>
-int get_section_index(ElfNN_Ehdr *ehdr, string& section_name)
+template<typename Elf>
+int get_section_index(typename Elf::Ehdr *ehdr, string& section_name)
 {
   int section_index = 0;
   /*
    * Scan through the section header string table looking for the
    * section with the name matching section_name
    */
-  auto [_, shstrbuf] = get_string_buffers<ElfNN_Shdr>(ehdr);
+  auto [_, shstrbuf] = get_string_buffers<Elf>(ehdr);
   if (section_name.size() > 0) {
     // Find section index for custom section
-    auto shdr = get_section_header<ElfNN_Shdr>(ehdr);
-    for (int secno=0; secno<ehdr->e_shnum; secno++, shdr++) {
+    auto shdr = get_section_header<Elf>(ehdr);
+    for (int secno=0; secno<Elf::get(ehdr->e_shnum); secno++, shdr++) {
       if (shdr->sh_name != 0) {
-	if (section_name == shstrbuf + shdr->sh_name) {
+	if (section_name == shstrbuf + Elf::get(shdr->sh_name)) {
 	  section_index = secno;
 	  // cout << "custom index is " << section_index << endl;
 	  break;
@@ -380,32 +940,32 @@ int get_section_index(ElfNN_Ehdr *ehdr, string& section_name)
  * to the Elf section named section_name.
  * Found function names are added to function_names.
  */
-template<typename ElfNN_Shdr, typename ElfNN_Sym, typename ElfNN_Ehdr>
-bool extract_function_names(ElfNN_Ehdr* ehdr, string& section_name,
+template<typename Elf>
+bool extract_function_names(string& filename, typename Elf::Ehdr* ehdr, string& section_name,
 			    vector<string>& function_names)
 {
   bool found = false;
 
-  int initial_function_number = function_names.size();
+  size_t initial_function_number = function_names.size();
 
   // Section header
   if (!ehdr->e_shoff) {
-    cout << "error: unable to find section header table\n";
+    LOG_ERROR(filename << ": unable to find section header table");
     return false;
   }
 
-  auto [strbuf, _] = get_string_buffers<ElfNN_Shdr>(ehdr);
-  int section_index = get_section_index<ElfNN_Shdr>(ehdr, section_name);
+  auto [strbuf, _] = get_string_buffers<Elf>(ehdr);
+  int section_index = get_section_index<Elf>(ehdr, section_name);
 
   /*
    * Look for symbols referencing the special section
    */
-  auto [symhdr, numsyms] = get_symbol_table<ElfNN_Shdr, ElfNN_Sym>(ehdr);
+  auto [symhdr, numsyms] = get_symbol_table<Elf>(ehdr);
   for (int n=0; n < numsyms; n++, symhdr++) {
     if (check_symbol_type(symhdr)) {
-      if (symhdr->st_shndx == section_index || section_name.size() == 0) {
-	string name = strbuf + symhdr->st_name;
-	cout << "test double list <= " << name << endl;
+      if (Elf::get(symhdr->st_shndx) == section_index || section_name.size() == 0) {
+	string name = strbuf + Elf::get(symhdr->st_name);
+	LOG_INFO(filename << ": test double list <= " << name);
 	function_names.push_back(name);
       }
     }
@@ -417,116 +977,607 @@ bool extract_function_names(ElfNN_Ehdr* ehdr, string& section_name,
   return found;
 }
 
-template <>
-void patch_file(Elf64_Sym *shdr, char* symbuf, vector<string>& function_names)
+/*
+ * The bind, type and visibility fields share st_info and st_other the
+ * same way in both classes so one definition serves Elf32 and Elf64.
+ * Only st_info and st_other are changed here, see fix_symbol_order()
+ * for the ordering of LOCAL symbols.
+ */
+template <typename Elf>
+bool patch_file(typename Elf::Sym *shdr, char* symbuf, SymbolRules& rules)
 {
-  // Maybe check also that it is GLOBAL?
-  // if (shdr->st_name != 0 && ELF64_ST_TYPE(shdr->st_info) == STT_FUNC) {
-  if (check_symbol_type(shdr)) {
-    for (auto p=function_names.begin(); p!=function_names.end(); p++) {
-      string func_name(symbuf + shdr->st_name);
-      if (*p == func_name) {
-	// cout << "patching " << func_name << " in " << *pFile << endl;
-	shdr->st_info = ELF64_ST_INFO(STB_WEAK, ELF64_ST_TYPE(shdr->st_info));
-      }
-    }
+  int type = ELF64_ST_TYPE(shdr->st_info);
+  if (shdr->st_name == 0 || type == STT_SECTION || type == STT_FILE)
+    return false;
+
+  SymbolRules::Action action;
+  if (!rules.match(symbuf + Elf::get(shdr->st_name), action))
+    return false;
+
+  int bind = ELF64_ST_BIND(shdr->st_info);
+  bool defined = shdr->st_shndx != SHN_UNDEF;
+  switch (action.bind) {
+  case STB_WEAK:
+    if (bind == STB_GLOBAL && (!action.func_only || type == STT_FUNC))
+      bind = STB_WEAK;
+    break;
+  case STB_LOCAL:
+    if (defined)
+      bind = STB_LOCAL;
+    break;
+  case STB_GLOBAL:
+    if (bind == STB_LOCAL && defined)
+      bind = STB_GLOBAL;
+    else if (action.func_only && bind == STB_WEAK && type == STT_FUNC)
+      bind = STB_GLOBAL;
+    break;
   }
+
+  unsigned char st_info = ELF64_ST_INFO(bind, type);
+  unsigned char st_other = shdr->st_other;
+  if (action.visibility >= 0)
+    st_other = (st_other & ~3) | action.visibility;
+
+  if (st_info == shdr->st_info && st_other == shdr->st_other)
+    return false;
+
+  shdr->st_info = st_info;
+  shdr->st_other = st_other;
+  return true;
 }
 
-template<>
-void patch_file(Elf32_Sym *shdr, char* symbuf, vector<string>& function_names)
+/*
+ * All LOCAL symbols must come before the others, sh_info of the symbol
+ * table being the index of the first non-local one.  Localizing or
+ * globalizing symbols breaks that, so misplaced entries are swapped in
+ * place and the relocation and group sections referring to them are
+ * renumbered.  Returns true if anything had to be moved.
+ */
+template<typename Elf>
+bool fix_symbol_order(typename Elf::Ehdr* ehdr)
 {
-  // Maybe check also that it is GLOBAL?
-  // if (shdr->st_name != 0 && ELF32_ST_TYPE(shdr->st_info) == STT_FUNC) {
-  if (check_symbol_type(shdr)) {
-    for (auto p=function_names.begin(); p!=function_names.end(); p++) {
-      string func_name(symbuf + shdr->st_name);
-      if (*p == func_name) {
-	// cout << "patching " << func_name << " in " << *pFile << endl;
-	shdr->st_info = ELF32_ST_INFO(STB_WEAK, ELF32_ST_TYPE(shdr->st_info));
-      }
-    }
+  char* base = (char*)ehdr;
+  auto shdr = get_section_header<Elf>(ehdr);
+  int nsecs = Elf::get(ehdr->e_shnum);
+
+  int symsec = 0;
+  while (symsec < nsecs && Elf::get(shdr[symsec].sh_type) != SHT_SYMTAB)
+    symsec++;
+  if (symsec == nsecs)
+    return false;
+
+  auto& symtab = shdr[symsec];
+  auto syms = (typename Elf::Sym*)(base + Elf::get(symtab.sh_offset));
+  size_t nsyms = Elf::get(symtab.sh_size) / Elf::get(symtab.sh_entsize);
+  auto is_local = [&](size_t i) { return ELF64_ST_BIND(syms[i].st_info) == STB_LOCAL; };
+
+  size_t first_global = Elf::get(symtab.sh_info);
+  size_t i = 1;
+  while (i < nsyms && is_local(i) == (i < first_global))
+    i++;
+  if (i == nsyms)
+    return false;
+
+  // Extended section indices run parallel to the symbol table
+  Elf32_Word* xindex = nullptr;
+  for (int secno = 0; secno < nsecs; secno++) {
+    if (Elf::get(shdr[secno].sh_type) == SHT_SYMTAB_SHNDX &&
+	(int)Elf::get(shdr[secno].sh_link) == symsec)
+      xindex = (Elf32_Word*)(base + Elf::get(shdr[secno].sh_offset));
   }
-}
 
-template<typename ElfNN_Ehdr, typename ElfNN_Shdr, typename ElfNN_Sym>
-void patch_files(vector<string>& objfiles, vector<string>& function_names)
-{
-  for(auto pFile = objfiles.begin(); pFile != objfiles.end(); pFile++) {
-    ElfFile<ElfNN_Ehdr> elfFile(*pFile);
+  // Partition with the fewest swaps, new_index maps old => new
+  vector<size_t> new_index(nsyms);
+  iota(new_index.begin(), new_index.end(), 0);
+  size_t j = nsyms - 1;
+  i = 1;
+  while (true) {
+    while (i < nsyms && is_local(i))
+      i++;
+    while (j > 0 && !is_local(j))
+      j--;
+    if (i >= j)
+      break;
+    swap(syms[i], syms[j]);
+    if (xindex)
+      swap(xindex[i], xindex[j]);
+    new_index[i] = j;
+    new_index[j] = i;
+  }
+  symtab.sh_info = Elf::put((decltype(symtab.sh_info))i);
 
-    auto ehdr = elfFile.Handle();
-    if (!ehdr)
+  for (int secno = 0; secno < nsecs; secno++) {
+    auto& sec = shdr[secno];
+    if ((int)Elf::get(sec.sh_link) != symsec)
       continue;
 
-    auto [symbuf, _] = get_string_buffers<ElfNN_Shdr>(ehdr);
-    auto [symhdr, nsyms] = get_symbol_table<ElfNN_Shdr, ElfNN_Sym>(ehdr);
-    for (int idx=0; idx < nsyms; idx++, symhdr++) {
-      patch_file<ElfNN_Sym>(symhdr, symbuf, function_names);
-    }
-
-    if (msync(ehdr, elfFile.Size(), MS_SYNC) != 0) {
-      perror("msync");
+    char* data = base + Elf::get(sec.sh_offset);
+    size_t count = Elf::get(sec.sh_entsize) ? Elf::get(sec.sh_size) / Elf::get(sec.sh_entsize) : 0;
+    switch (Elf::get(sec.sh_type)) {
+    case SHT_REL:
+      for (auto rel = (typename Elf::Rel*)data; count-- > 0; rel++) {
+	auto info = Elf::get(rel->r_info);
+	rel->r_info = Elf::put(Elf::r_info(new_index[Elf::r_sym(info)], info));
+      }
+      break;
+    case SHT_RELA:
+      for (auto rela = (typename Elf::Rela*)data; count-- > 0; rela++) {
+	auto info = Elf::get(rela->r_info);
+	rela->r_info = Elf::put(Elf::r_info(new_index[Elf::r_sym(info)], info));
+      }
+      break;
+    case SHT_GROUP:
+      // the signature symbol
+      sec.sh_info = Elf::put((decltype(sec.sh_info))new_index[Elf::get(sec.sh_info)]);
+      break;
+    case SHT_LLVM_ADDRSIG:
+      // ULEB128 symbol indices can't be renumbered in place, a zero
+      // sh_link tells the linker to ignore the section
+      sec.sh_link = 0;
+      break;
     }
   }
+  return true;
 }
 
-template<typename ElfNN_Shdr, typename ElfNN_Sym, typename ElfNN_Ehdr>
-void extract_function_names(ElfNN_Ehdr* ehdr, vector<string>& funclist)
+/*
+ * As dispatch_elf() below for an Elf image already in memory and
+ * checked by verify_elf().
+ */
+template<typename Kernel>
+bool dispatch_elf_image(Elf64_Ehdr* ehdr, size_t size, Kernel kernel)
 {
-  string secname("");
-  (void)extract_function_names<ElfNN_Shdr, ElfNN_Sym>(ehdr, secname, funclist);
+  bool msb = ehdr->e_ident[EI_DATA] == ELFDATA2MSB;
+  switch (ehdr->e_ident[EI_CLASS]) {
+  case ELFCLASS32:
+    if (msb)
+      kernel.template operator()<Elf32MSB>((Elf32_Ehdr*)ehdr, size);
+    else
+      kernel.template operator()<Elf32LSB>((Elf32_Ehdr*)ehdr, size);
+    break;
+  case ELFCLASS64:
+    if (msb)
+      kernel.template operator()<Elf64MSB>(ehdr, size);
+    else
+      kernel.template operator()<Elf64LSB>(ehdr, size);
+    break;
+  default:
+    return false;
+  }
+  return true;
 }
 
-template<typename ElfNN_Ehdr, typename ElfNN_Shdr, typename ElfNN_Sym>
-void extract_function_names(vector<string>& dupfiles, vector<string>& funclist)
+/*
+ * Maps filename and calls kernel, a generic lambda taking the
+ * ElfTraits as its template parameter, with the traits matching the
+ * class and byte order of the file:
+ *
+ *   kernel.template operator()<Elf>(typename Elf::Ehdr* ehdr, size_t size)
+ *
+ * This is the only place the file format is looked at, everything
+ * the kernel calls is specialized for it.  Returns false if the file
+ * is not a supported Elf file.
+ */
+template<typename Kernel>
+bool dispatch_elf(string& filename, bool writable, Kernel kernel)
 {
-  for (auto pFile = dupfiles.begin(); pFile != dupfiles.end(); pFile++) {
-    ElfFile<ElfNN_Ehdr> elfFile(*pFile);
-    
-    auto ehdr = elfFile.Handle();
-    if (ehdr)
-      extract_function_names<ElfNN_Shdr, ElfNN_Sym>(ehdr, funclist);
-  }
+  // only the common e_ident part of the header is examined here
+  ElfFile<Elf64_Ehdr> elfFile(filename, writable);
+
+  auto ehdr = elfFile.Handle();
+  if (!ehdr)
+    return false;
+
+  return dispatch_elf_image(ehdr, elfFile.Size(), kernel);
 }
 
-/**
- * Extract from infiles function names contained in funclist that are
- * located in the section_name text section and save those files to
- * outfiles.  
- * @param infiles list of input filenames 
- * @param funclist list of function names 
- * @param section_name the name of a labeled elf text section.
- * Labeled in C/C++ code with the attribute,
- * `__attribute__((section("NAME")))`
+/*
+ * A patch plan separates finding the symbols to weaken from writing
+ * them.  Planning maps the object files read-only and records, per
+ * file, the byte offsets of the st_info fields to change.  Applying
+ * does no Elf parsing at all: it checks each file's fingerprint and
+ * the expected old values and then writes just those bytes.
+ *
+ * The plan is a text file:
+ *
+ *   file SIZE DIGEST PATH
+ *   sym INDEX OFFSET OLD NEW
+ *   byte OFFSET OLD NEW
+ *   ...
+ *
+ * where DIGEST is the FNV-1a hash of the file contents before
+ * patching and each following 'sym' line is a changed byte of symbol
+ * table entry INDEX of that file.  'byte' lines are changes outside
+ * the symbol table, made when symbols have to be reordered.
  */
-template<typename ElfNN_Ehdr, typename ElfNN_Shdr, typename ElfNN_Sym>
-void extract_labeled_function_names(vector<string>& infiles, vector<string>& funclist,
-				    string& section_name, vector<string>& outfiles)
-{
-  for(auto pFile = infiles.begin(); pFile != infiles.end(); pFile++) {
-    ElfFile<ElfNN_Ehdr> elfFile(*pFile);
+class PatchPlan {
+public:
+  struct Patch {
+    long index;			// symbol table index, -1 if none
+    unsigned long offset;	// file offset of the changed byte
+    unsigned old_value;
+    unsigned new_value;
+  };
+
+  struct File {
+    string path;
+    off_t size;
+    uint64_t digest;
+    vector<Patch> patches;
+  };
+
+  PatchPlan() : planning(false) {}
+
+  void enable() { planning = true; }
+  bool enabled() { return planning; }
+
+  void add_file(string& path, off_t size, uint64_t digest) {
+    files.push_back({path, size, digest, {}});
+  }
 
-    auto ehdr = elfFile.Handle();
-    if (!ehdr)
-      continue;
+  void add_patch(long index, unsigned long offset, unsigned old_value, unsigned new_value) {
+    files.back().patches.push_back({index, offset, old_value, new_value});
+  }
 
-    if (!extract_function_names<ElfNN_Shdr, ElfNN_Sym>(ehdr, section_name, funclist)) {
-      outfiles.push_back(*pFile);
+  bool write(string& filename) {
+    ofstream out(filename);
+    if (!out) {
+      LOG_ERROR("unable to write plan " << filename);
+      return false;
     }
+
+    out << "# mk-weakfunc-elf patch plan\n";
+    for (auto f = files.begin(); f != files.end(); f++) {
+      if (f->patches.size() == 0)
+	continue;
+      out << "file " << f->size << ' ' << f->digest << ' ' << f->path << '\n';
+      for (auto p = f->patches.begin(); p != f->patches.end(); p++) {
+	if (p->index >= 0)
+	  out << "sym " << p->index << ' ';
+	else
+	  out << "byte ";
+	out << p->offset << ' ' << p->old_value << ' ' << p->new_value << '\n';
+      }
+    }
+    return true;
   }
-}
 
-template<typename ElfNN_Ehdr, typename ElfNN_Shdr, typename ElfNN_Sym>
-void process_files(vector<string>& infiles, vector<string>& dupfiles, vector<string>& funclist,
-		   string& section_name, bool write_flag)
+  bool read(string& filename) {
+    ifstream in(filename);
+    if (!in) {
+      LOG_ERROR("unable to read plan " << filename);
+      return false;
+    }
+
+    string line;
+    while (getline(in, line)) {
+      istringstream fields(line);
+      string kind;
+      fields >> kind;
+      if (kind == "file") {
+	File f;
+	fields >> f.size >> f.digest >> ws;
+	getline(fields, f.path);
+	if (!fields.fail() && f.path.size() > 0) {
+	  files.push_back(f);
+	  continue;
+	}
+      } else if ((kind == "sym" || kind == "byte") && files.size() > 0) {
+	Patch p = {-1, 0, 0, 0};
+	auto& patches = files.back().patches;
+	if ((kind == "byte" || fields >> p.index) &&
+	    fields >> p.offset >> p.old_value >> p.new_value &&
+	    (patches.size() == 0 || p.offset > patches.back().offset)) {
+	  patches.push_back(p);
+	  continue;
+	}
+      } else if (kind.size() == 0 || kind[0] == '#') {
+	continue;
+      }
+      LOG_ERROR(filename << ": malformed plan: " << line);
+      return false;
+    }
+    return true;
+  }
+
+  /*
+   * Applies the plan to the files on disk.  Files whose contents no
+   * longer match the plan are left untouched.  Returns true if every
+   * file was patched.
+   */
+  bool apply() {
+    bool ok = true;
+    for (auto f = files.begin(); f != files.end(); f++) {
+      FileLock lock(f->path);
+      if (!apply(*f)) {
+	LOG_ERROR(f->path << ": plan does not match");
+	ok = false;
+      }
+    }
+    return ok;
+  }
+
+private:
+  bool apply(File& f) {
+    auto [ptr, size] = memory_map_file(f.path);
+    if (ptr == nullptr)
+      return false;
+
+    auto bytes = (unsigned char*)ptr;
+    bool match = (off_t)size == f.size;
+    for (auto p = f.patches.begin(); match && p != f.patches.end(); p++) {
+      match = p->offset < size &&
+	(bytes[p->offset] == p->old_value || bytes[p->offset] == p->new_value);
+    }
+    match = match && original_digest(f, bytes, size) == f.digest;
+
+    bool changed = false;
+    for (auto p = f.patches.begin(); match && p != f.patches.end(); p++) {
+      if (bytes[p->offset] != p->new_value) {
+	bytes[p->offset] = p->new_value;
+	changed = true;
+      }
+    }
+
+    if (changed && msync(ptr, size, MS_SYNC) != 0)
+      LOG_ERRNO(f.path << ": msync");
+
+    if (munmap(ptr, size) < 0)
+      LOG_ERRNO(f.path << ": munmap");
+
+    if (match)
+      LOG_VERBOSE(f.path << ": applied " << f.patches.size() << " changes");
+    return match;
+  }
+
+  /*
+   * Hash of the file contents as they were when planned, so applying
+   * an already applied plan is harmless.  Patches are in offset order.
+   */
+  uint64_t original_digest(File& f, unsigned char* bytes, size_t size) {
+    uint64_t hash = fnv1a(nullptr, 0);
+    size_t pos = 0;
+    for (auto p = f.patches.begin(); p != f.patches.end(); p++) {
+      unsigned char old_value = p->old_value;
+      hash = fnv1a(bytes + pos, p->offset - pos, hash);
+      hash = fnv1a(&old_value, 1, hash);
+      pos = p->offset + 1;
+    }
+    return fnv1a(bytes + pos, size - pos, hash);
+  }
+
+  bool planning;
+  vector<File> files;
+};
+
+// Records rather than writes the changes when --plan is given
+PatchPlan patch_plan;
+
+static string field_name(map<int, string>& names, int value)
+{
+  auto p = names.find(value);
+  return p != names.end() ? p->second : to_string(value);
+}
+
+/*
+ * Describes a symbol change as, for example, "GLOBAL => WEAK".
+ */
+static string symbol_change(unsigned char old_info, unsigned char old_other,
+			    unsigned char new_info, unsigned char new_other)
+{
+  string s;
+  if (ELF64_ST_BIND(old_info) != ELF64_ST_BIND(new_info))
+    s += field_name(stb_name, ELF64_ST_BIND(old_info)) + " => " + field_name(stb_name, ELF64_ST_BIND(new_info));
+  if (ELF64_ST_VISIBILITY(old_other) != ELF64_ST_VISIBILITY(new_other)) {
+    if (s.size() > 0)
+      s += ", ";
+    s += field_name(stv_name, ELF64_ST_VISIBILITY(old_other)) + " => " +
+      field_name(stv_name, ELF64_ST_VISIBILITY(new_other));
+  }
+  return s;
+}
+
+/*
+ * Applies the rules to every symbol of the mapped object file in a
+ * single pass over the symbol table.  Returns true if anything changed.
+ */
+template<typename Elf>
+bool apply_rules(string& filename, typename Elf::Ehdr* ehdr, SymbolRules& rules)
+{
+  bool changed = false;
+  auto [symbuf, _] = get_string_buffers<Elf>(ehdr);
+  auto [symhdr, nsyms] = get_symbol_table<Elf>(ehdr);
+  for (int idx=0; idx < nsyms; idx++, symhdr++) {
+    unsigned char st_info = symhdr->st_info;
+    unsigned char st_other = symhdr->st_other;
+    if (patch_file<Elf>(symhdr, symbuf, rules)) {
+      LOG_VERBOSE(filename << ": " << symbuf + Elf::get(symhdr->st_name) << " " <<
+		  symbol_change(st_info, st_other, symhdr->st_info, symhdr->st_other));
+      changed = true;
+    }
+  }
+
+  if (changed && fix_symbol_order<Elf>(ehdr))
+    LOG_VERBOSE(filename << ": reordered LOCAL symbols");
+
+  return changed;
+}
+
+/*
+ * Applies the rules to a private copy of the object file and adds the
+ * bytes that changed to the plan.
+ */
+template<typename Elf>
+void plan_file(string& filename, typename Elf::Ehdr* ehdr, size_t size, SymbolRules& rules)
+{
+  auto [original, original_size] = memory_map_file(filename, false);
+  if (original == nullptr)
+    return;
+
+  auto before = (unsigned char*)original;
+  auto after = (unsigned char*)ehdr;
+  patch_plan.add_file(filename, size, fnv1a(before, size));
+
+  if (apply_rules<Elf>(filename, ehdr, rules)) {
+    auto [symhdr, nsyms] = get_symbol_table<Elf>(ehdr);
+    size_t symoff = (unsigned char*)symhdr - after;
+    size_t symend = symoff + nsyms * sizeof(typename Elf::Sym);
+
+    const size_t block = 4096;
+    for (size_t start = 0; start < size; start += block) {
+      size_t end = min(start + block, size);
+      if (memcmp(before + start, after + start, end - start) == 0)
+	continue;
+      for (size_t off = start; off < end; off++) {
+	if (before[off] == after[off])
+	  continue;
+	long index = (off >= symoff && off < symend) ? (off - symoff) / sizeof(typename Elf::Sym) : -1;
+	patch_plan.add_patch(index, off, before[off], after[off]);
+      }
+    }
+  }
+
+  if (munmap(original, original_size) < 0)
+    LOG_ERRNO(filename << ": munmap");
+}
+
+/*
+ * Applies the rules to a writable mapping of filename.
+ */
+template<typename Elf>
+void patch_symbols(string& filename, typename Elf::Ehdr* ehdr, size_t size, SymbolRules& rules)
+{
+  // Nothing written, nothing to sync
+  if (apply_rules<Elf>(filename, ehdr, rules) && msync(ehdr, size, MS_SYNC) != 0) {
+    LOG_ERRNO(filename << ": msync");
+  }
+}
+
+bool patch_files(vector<string>& objfiles, SymbolRules& rules)
+{
+  bool all_ok = true;
+  uint64_t digest = rules.digest();
+
+  for(auto pFile = objfiles.begin(); pFile != objfiles.end(); pFile++) {
+    if (patch_plan.enabled()) {
+      all_ok &= dispatch_elf(*pFile, false, [&]<typename Elf>(typename Elf::Ehdr* ehdr, size_t size) {
+	plan_file<Elf>(*pFile, ehdr, size, rules);
+      });
+      continue;
+    }
+
+    /*
+     * Serialize with concurrent invocations patching the same file and
+     * skip it if one of them has already done the work.
+     */
+    FileLock lock(*pFile);
+    if (patch_state.is_current(*pFile, digest)) {
+      LOG_VERBOSE(*pFile << ": already patched");
+      continue;
+    }
+
+    bool ok = dispatch_elf(*pFile, true, [&]<typename Elf>(typename Elf::Ehdr* ehdr, size_t size) {
+      patch_symbols<Elf>(*pFile, ehdr, size, rules);
+    });
+
+    if (ok)
+      patch_state.record(*pFile, digest);
+    all_ok &= ok;
+  }
+  return all_ok;
+}
+
+bool extract_function_names(vector<string>& dupfiles, vector<string>& funclist)
+{
+  bool all_ok = true;
+  string secname("");
+
+  for (auto pFile = dupfiles.begin(); pFile != dupfiles.end(); pFile++) {
+    all_ok &= dispatch_elf(*pFile, false, [&]<typename Elf>(typename Elf::Ehdr* ehdr, size_t) {
+      (void)extract_function_names<Elf>(*pFile, ehdr, secname, funclist);
+    });
+  }
+  return all_ok;
+}
+
+/**
+ * Extract from infiles function names contained in funclist that are
+ * located in the section_name text section and save those files to
+ * outfiles.  
+ * @param infiles list of input filenames 
+ * @param funclist list of function names 
+ * @param section_name the name of a labeled elf text section.
+ * Labeled in C/C++ code with the attribute,
+ * `__attribute__((section("NAME")))`
+ * @param labeled_files if given, saves the labeled files
+ */
+bool extract_labeled_function_names(vector<string>& infiles, vector<string>& funclist,
+				    string& section_name, vector<string>& outfiles,
+				    vector<string>* labeled_files = nullptr)
+{
+  bool all_ok = true;
+
+  for(auto pFile = infiles.begin(); pFile != infiles.end(); pFile++) {
+    bool labeled = false;
+    bool ok = dispatch_elf(*pFile, false, [&]<typename Elf>(typename Elf::Ehdr* ehdr, size_t) {
+      labeled = extract_function_names<Elf>(*pFile, ehdr, section_name, funclist);
+    });
+
+    if (ok && !labeled) {
+      outfiles.push_back(*pFile);
+    } else if (ok && labeled_files) {
+      labeled_files->push_back(*pFile);
+    }
+    all_ok &= ok;
+  }
+  return all_ok;
+}
+
+/*
+ * Reads file names from a --files-from list.  Names are separated by
+ * NUL or newline characters, whichever comes first in the stream, and
+ * each one is returned as soon as it is complete.
+ */
+class FileListReader {
+public:
+  FileListReader(istream& _in) : in(_in), delim(0) {}
+
+  bool next(string& filename) {
+    filename.clear();
+    int c;
+    while ((c = in.get()) != EOF) {
+      if (delim == 0 && (c == '\0' || c == '\n'))
+	delim = c;
+      if (c == delim) {
+	if (filename.size() > 0)
+	  return true;
+	continue;
+      }
+      filename.push_back(c);
+    }
+    return filename.size() > 0;
+  }
+
+private:
+  istream& in;
+  int delim;
+};
+
+/*
+ * Each file is dispatched on its own Elf class and byte order so one
+ * run may mix Elf32, Elf64 and big-endian objects.  Returns false if
+ * any of the files could not be processed.
+ */
+bool process_files(vector<string>& infiles, vector<string>& dupfiles, vector<string>& funclist,
+		   SymbolRules& rules, string& prefix_name, string& section_name, bool write_flag,
+		   istream* files_from)
 {
   /**
    * First build up a list of function names we want to replace from
    * the list of explicit mock files.  All global function names
    * defined in these files will be included.
    */
-  extract_function_names<ElfNN_Ehdr, ElfNN_Shdr, ElfNN_Sym>(dupfiles, funclist);
+  bool ok = extract_function_names(dupfiles, funclist);
 
   /**
    * Identify object files with an identifed, i.e. labeled, section
@@ -535,27 +1586,753 @@ void process_files(vector<string>& infiles, vector<string>& dupfiles, vector<str
    * sections.
    */
   vector<string> objfiles;	// candidate files for modification
-  extract_labeled_function_names<ElfNN_Ehdr, ElfNN_Shdr, ElfNN_Sym>(infiles, funclist, section_name, objfiles);
+  vector<string> doubles(dupfiles);	// only see the --rules
+  ok &= extract_labeled_function_names(infiles, funclist, section_name, objfiles, &doubles);
 
   /**
-   * The non-mock files are the ones to modify
+   * Files named on the --files-from stream are classified and scanned
+   * as each one arrives, overlapping with whatever is still writing
+   * the list.  Only the patching below needs the complete set.
    */
-  if (write_flag)
-    patch_files<ElfNN_Ehdr, ElfNN_Shdr, ElfNN_Sym>(objfiles, funclist);
+  if (files_from) {
+    FileListReader reader(*files_from);
+    string filename;
+    while (reader.next(filename)) {
+      vector<string> files{filename};
+      if (file_has_select_prefix(filename, prefix_name)) {
+	ok &= extract_function_names(files, funclist);
+	doubles.push_back(filename);
+      } else {
+	ok &= extract_labeled_function_names(files, funclist, section_name, objfiles, &doubles);
+      }
+    }
+  }
 
+  /**
+   * The non-mock files are the ones to modify, in one pass for the
+   * test doubles and any --rules.  The test doubles themselves are
+   * never weakened but do get the --rules.
+   */
+  if (write_flag) {
+    SymbolRules all_rules(rules);
+    all_rules.add_test_doubles(funclist);
+    ok &= patch_files(objfiles, all_rules);
+    if (!rules.empty())
+      ok &= patch_files(doubles, rules);
+  }
+
+  return ok;
 }
 
+/*
+ * Replaces each '@FILE' argument with the whitespace separated
+ * arguments read from FILE, as gcc and ld do.  Single and double
+ * quotes and backslash escapes group characters into one argument and
+ * response files may name further response files.  Arguments after
+ * '--' belong to the --compile-wrap command and are left alone.
+ */
+bool expand_response_files(vector<string>& args, size_t start = 1, int depth = 0)
+{
+  size_t n = start;
+  while (n < args.size()) {
+    if (args[n] == "--")
+      return true;
+    if (args[n].size() < 2 || args[n][0] != '@') {
+      n++;
+      continue;
+    }
+
+    string filename = args[n].substr(1);
+    if (depth > 10) {
+      LOG_ERROR(filename << ": response files nested too deeply");
+      return false;
+    }
+    ifstream in(filename);
+    if (!in) {
+      LOG_ERROR("unable to read response file " << filename);
+      return false;
+    }
+
+    vector<string> expanded;
+    string arg;
+    bool in_arg = false;
+    char quote = 0;
+    int c;
+    while ((c = in.get()) != EOF) {
+      if (c == '\\' && quote != '\'') {
+	if ((c = in.get()) == EOF)
+	  break;
+      } else if (quote) {
+	if (c == quote) {
+	  quote = 0;
+	  continue;
+	}
+      } else if (c == '\'' || c == '"') {
+	quote = c;
+	in_arg = true;
+	continue;
+      } else if (isspace(c)) {
+	if (in_arg)
+	  expanded.push_back(arg);
+	arg.clear();
+	in_arg = false;
+	continue;
+      }
+      arg.push_back(c);
+      in_arg = true;
+    }
+    if (in_arg)
+      expanded.push_back(arg);
+
+    if (!expand_response_files(expanded, 0, depth + 1))
+      return false;
+    args.erase(args.begin() + n);
+    args.insert(args.begin() + n, expanded.begin(), expanded.end());
+    if (find(expanded.begin(), expanded.end(), "--") != expanded.end())
+      return true;
+    n += expanded.size();
+  }
+  return true;
+}
+
+/*
+ * Reads test double function names from a manifest file, one name
+ * per line.  Blank lines and lines starting with '#' are ignored.
+ */
+bool read_manifest(string& filename, vector<string>& funclist)
+{
+  ifstream in(filename);
+  if (!in) {
+    LOG_ERROR("unable to read manifest " << filename);
+    return false;
+  }
+
+  string line;
+  while (getline(in, line)) {
+    if (line.size() == 0 || line[0] == '#')
+      continue;
+    funclist.push_back(line);
+  }
+  return true;
+}
+
+/*
+ * Saves the function list in the format read by read_manifest().
+ */
+bool write_manifest(string& filename, vector<string>& funclist)
+{
+  ofstream out(filename);
+  if (!out) {
+    LOG_ERROR("unable to write manifest " << filename);
+    return false;
+  }
+
+  for (auto p = funclist.begin(); p != funclist.end(); p++)
+    out << *p << '\n';
+  return true;
+}
+
+static bool has_source_suffix(string& arg)
+{
+  static const vector<string> suffixes = {
+    ".c", ".cc", ".cpp", ".cxx", ".c++", ".C", ".s", ".S"
+  };
+  for (auto p = suffixes.begin(); p != suffixes.end(); p++) {
+    if (arg.size() > p->size() &&
+	arg.compare(arg.size() - p->size(), p->size(), *p) == 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Works out the object file(s) a compiler command line will produce:
+ * either the argument to '-o' or, for 'cc -c a.c b.c', a.o and b.o
+ * in the current directory.  Commands without '-c', or which stop
+ * before assembling with '-E' or '-S', produce no object files.
+ */
+vector<string> get_compile_outputs(vector<string>& command)
+{
+  vector<string> outputs;
+  bool compile_only = false;
+  string output;
+
+  for (auto p = command.begin() + 1; p < command.end(); p++) {
+    if (*p == "-o" && p + 1 < command.end())
+      output = *++p;
+    else if (p->substr(0, 2) == "-o" && p->size() > 2)
+      output = p->substr(2);
+    else if (*p == "-c")
+      compile_only = true;
+    else if (*p == "-E" || *p == "-S")
+      return outputs;
+  }
+
+  if (!compile_only)
+    return outputs;
+
+  if (output.size() > 0)
+    return {output};
+
+  for (auto p = command.begin() + 1; p < command.end(); p++) {
+    if ((*p)[0] != '-' && has_source_suffix(*p)) {
+      auto name = get_last_directory_segment(*p, '/');
+      outputs.push_back(name.substr(0, name.rfind('.')) + ".o");
+    }
+  }
+  return outputs;
+}
+
+/*
+ * Runs command and waits for it to finish.  Returns the exit status
+ * of the command or -1 if it could not be run.
+ */
+int run_command(vector<string>& command)
+{
+  vector<char*> args;
+  for (auto p = command.begin(); p != command.end(); p++)
+    args.push_back(p->data());
+  args.push_back(nullptr);
+
+  log_flush();			// or the child inherits the buffer
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG_ERRNO("fork");
+    return -1;
+  }
+
+  if (pid == 0) {
+    execvp(args[0], args.data());
+    LOG_ERRNO(args[0]);
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    LOG_ERRNO("waitpid");
+    return -1;
+  }
+
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return -1;
+}
+
+/*
+ * Compiler wrapper mode: runs the compiler and then weakens the test
+ * double functions found in funclist in just the object file(s) it
+ * produced.  This moves the patching off the link step and lets it
+ * run in parallel with the rest of the compilation.
+ */
+int compile_wrap(vector<string>& command, vector<string>& dupfiles, vector<string>& funclist,
+		 SymbolRules& rules, string& prefix_name, string& section_name)
+{
+  if (command.size() == 0) {
+    LOG_ERROR("no compiler command given");
+    return 1;
+  }
+
+  int status = run_command(command);
+  if (status != 0)
+    return status < 0 ? 1 : status;
+
+  /*
+   * Outputs which are not regular files, such as the '-o /dev/null'
+   * of configure probes or '-o -', are left alone.  Test doubles are
+   * never weakened but do get the --rules.
+   */
+  auto outputs = get_compile_outputs(command);
+  vector<string> infiles;
+  vector<string> doubles;
+  for (auto pFile = outputs.begin(); pFile != outputs.end(); pFile++) {
+    struct stat statbuf;
+    if (stat(pFile->c_str(), &statbuf) || !S_ISREG(statbuf.st_mode))
+      continue;
+    if (file_has_select_prefix(*pFile, prefix_name))
+      doubles.push_back(*pFile);
+    else
+      infiles.push_back(*pFile);
+  }
+
+  if (infiles.size() == 0 && (doubles.size() == 0 || rules.empty()))
+    return 0;
+
+  // the -r files only supply names, they belong to other compiles
+  if (!extract_function_names(dupfiles, funclist))
+    return 1;
+  if (!process_files(infiles, doubles, funclist, rules, prefix_name, section_name, true))
+    return 1;
+
+  return 0;
+}
+
+static bool write_all(int fd, const char* buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+/*
+ * Moves everything readable from fd into a new memfd, with splice()
+ * when fd is a pipe so the data never passes through user space.
+ * Returns the memfd or -1.
+ */
+static int read_into_memfd(int fd, string& name)
+{
+  int memfd = memfd_create("mk-weakfunc-elf", MFD_CLOEXEC);
+  if (memfd < 0) {
+    LOG_ERRNO("memfd_create");
+    return -1;
+  }
+
+  bool use_splice = true;
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t n;
+    if (use_splice) {
+      n = splice(fd, nullptr, memfd, nullptr, 1 << 20, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINVAL) {
+	use_splice = false;	// not a pipe
+	continue;
+      }
+    } else {
+      n = read(fd, buf, sizeof(buf));
+      if (n > 0 && !write_all(memfd, buf, n)) {
+	LOG_ERRNO("memfd: write");
+	close(memfd);
+	return -1;
+      }
+    }
+
+    if (n == 0)
+      break;
+    if (n < 0 && errno != EINTR) {
+      LOG_ERRNO(name << ": read");
+      close(memfd);
+      return -1;
+    }
+  }
+  return memfd;
+}
+
+/*
+ * Filter mode: reads one object file from fd, weakens the test double
+ * functions and writes the result to stdout.  Nothing is written to
+ * the file system.  A regular file is mapped copy-on-write, anything
+ * else is first moved into a memfd, and the patched mapping itself is
+ * written out so only the pages holding changed symbols are ever
+ * copied.  As with the link, an object with functions in the labeled
+ * section_name is a test double and only gets the --rules.
+ */
+int filter_object(int fd, vector<string>& dupfiles, vector<string>& funclist, SymbolRules& rules,
+		  string& section_name)
+{
+  string name = fd == 0 ? string("<stdin>") : "fd " + to_string(fd);
+
+  struct stat statbuf;
+  if (fstat(fd, &statbuf)) {
+    LOG_ERRNO(name);
+    return 1;
+  }
+
+  int mapfd = fd;
+  if (!S_ISREG(statbuf.st_mode) && (mapfd = read_into_memfd(fd, name)) < 0)
+    return 1;
+
+  // the input file itself is never modified
+  auto [ptr, size] = memory_map_fd(mapfd, name, mapfd != fd);
+  if (mapfd != fd)
+    close(mapfd);
+  if (ptr == nullptr)
+    return 1;
+
+  bool ok = false;
+  if (size < sizeof(Elf32_Ehdr)) {
+    LOG_ERROR(name << ": not an Elf file");
+  } else if (verify_elf(ptr, name)) {
+    ok = extract_function_names(dupfiles, funclist);
+
+    SymbolRules all_rules(rules);
+    all_rules.add_test_doubles(funclist);
+    ok &= dispatch_elf_image((Elf64_Ehdr*)ptr, size, [&]<typename Elf>(typename Elf::Ehdr* ehdr, size_t) {
+      vector<string> labeled;
+      bool is_double = extract_function_names<Elf>(name, ehdr, section_name, labeled);
+      (void)apply_rules<Elf>(name, ehdr, is_double ? rules : all_rules);
+    });
+
+    if (ok && !write_all(STDOUT_FILENO, (const char*)ptr, size)) {
+      LOG_ERRNO("stdout: write");
+      ok = false;
+    }
+  }
+
+  if (munmap(ptr, size) < 0)
+    LOG_ERRNO(name << ": munmap");
+  return ok ? 0 : 1;
+}
+
+/*
+ * Adds the names of the GLOBAL functions defined in the mapped object
+ * file.  Functions which are already WEAK are left out: they may be
+ * weak in the source and must never be restored to GLOBAL.
+ */
+template<typename Elf>
+void extract_patchable_functions(typename Elf::Ehdr* ehdr, vector<string>& function_names)
+{
+  auto [strbuf, _] = get_string_buffers<Elf>(ehdr);
+  auto [symhdr, numsyms] = get_symbol_table<Elf>(ehdr);
+  for (int n=0; n < numsyms; n++, symhdr++) {
+    if (check_symbol_type(symhdr) && symhdr->st_shndx != SHN_UNDEF)
+      function_names.push_back(strbuf + Elf::get(symhdr->st_name));
+  }
+}
+
+/*
+ * Watch mode keeps the test double index in memory and patches object
+ * files as the build writes them into the watched directories.  A
+ * rebuilt test double also re-patches the objects defining any
+ * function it added or removed, so by the time the link starts all
+ * objects are consistent with the current set of test doubles.
+ */
+class Watcher {
+public:
+  Watcher(vector<string>& _dupfiles, vector<string>& _funclist, SymbolRules& _rules,
+	  string& _prefix_name, string& _section_name) :
+    rules(_rules), prefix_name(_prefix_name), section_name(_section_name) {
+    // explicitly given test doubles never change
+    vector<string> names(_funclist);
+    (void)extract_function_names(_dupfiles, names);
+    for (auto p = names.begin(); p != names.end(); p++)
+      doubles[*p]++;
+  }
+
+  ~Watcher() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  /*
+   * Runs until killed.  Returns false if the directories could not be
+   * watched.
+   */
+  bool run(vector<string>& dirs) {
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+      LOG_ERRNO("inotify_init1");
+      return false;
+    }
+
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+    for (auto p = dirs.begin(); p != dirs.end(); p++) {
+      int wd = inotify_add_watch(fd, p->c_str(), mask);
+      if (wd < 0) {
+	LOG_ERRNO(*p);
+	return false;
+      }
+      watches[wd] = *p;
+    }
+
+    rescan();
+    LOG_INFO("watching " << dirs.size() << " directories, " << objects.size() <<
+	     " object files, " << doubles.size() << " test doubles");
+    log_flush();
+
+    alignas(struct inotify_event) char buf[64 * 1024];
+    while (true) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n < 0) {
+	if (errno == EINTR)
+	  continue;
+	LOG_ERRNO("inotify read");
+	return false;
+      }
+
+      bool overflow = false;
+      for (char* p = buf; p < buf + n; ) {
+	auto event = (struct inotify_event*)p;
+	p += sizeof(struct inotify_event) + event->len;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+	  overflow = true;
+	  continue;
+	}
+	string name = event->len ? event->name : "";
+	if (!is_object(name) || watches.count(event->wd) == 0)
+	  continue;
+
+	string path = watches[event->wd] + "/" + name;
+	if (event->mask & (IN_MOVED_FROM | IN_DELETE))
+	  forget(path);
+	else
+	  update(path);
+      }
+      patch_pending();
+
+      if (overflow) {
+	LOG_INFO("inotify queue overflow, rescanning");
+	rescan();
+      }
+      log_flush();
+    }
+  }
+
+private:
+  /*
+   * Brings the index up to date with the watched directories, test
+   * doubles first, and patches whatever needs it.  Unchanged files are
+   * skipped by their fingerprint.
+   */
+  void rescan() {
+    vector<string> found;
+    for (auto p = watches.begin(); p != watches.end(); p++)
+      list_objects(p->second, found);
+
+    set<string> present(found.begin(), found.end());
+    vector<string> gone;
+    for (auto p = seen.begin(); p != seen.end(); p++) {
+      if (present.count(p->first) == 0)
+	gone.push_back(p->first);
+    }
+    for (auto p = gone.begin(); p != gone.end(); p++)
+      forget(*p);
+
+    sort(found.begin(), found.end(), [&](string& a, string& b) {
+      return file_has_select_prefix(a, prefix_name) > file_has_select_prefix(b, prefix_name);
+    });
+    for (auto p = found.begin(); p != found.end(); p++)
+      update(*p);
+    patch_pending();
+  }
+
+  static bool is_object(const string& name) {
+    return name.size() > 2 && name.compare(name.size() - 2, 2, ".o") == 0;
+  }
+
+  static void list_objects(string& dir, vector<string>& files) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+      LOG_ERRNO(dir);
+      return;
+    }
+    while (struct dirent* entry = readdir(d)) {
+      if (is_object(entry->d_name))
+	files.push_back(dir + "/" + entry->d_name);
+    }
+    closedir(d);
+  }
+
+  /*
+   * The inode, size and mtime of a file.  Events for files which still
+   * match what was last seen, such as closing our own writable
+   * mapping, are ignored.
+   */
+  static tuple<ino_t, off_t, time_t, long> fingerprint(string& filename) {
+    struct stat statbuf;
+    if (stat(filename.c_str(), &statbuf))
+      return {0, -1, 0, 0};
+    return {statbuf.st_ino, statbuf.st_size, statbuf.st_mtim.tv_sec, statbuf.st_mtim.tv_nsec};
+  }
+
+  /*
+   * Re-scans a new or rebuilt file and works out which objects need
+   * patching.
+   */
+  void update(string& filename) {
+    auto p = seen.find(filename);
+    if (p != seen.end() && p->second == fingerprint(filename))
+      return;
+
+    forget(filename);
+
+    vector<string> names;
+    bool is_double = file_has_select_prefix(filename, prefix_name);
+    bool ok = dispatch_elf(filename, false, [&]<typename Elf>(typename Elf::Ehdr* ehdr, size_t) {
+      if (is_double)
+	(void)extract_function_names<Elf>(filename, ehdr, empty_name, names);
+      else if (extract_function_names<Elf>(filename, ehdr, section_name, names))
+	is_double = true;
+      else
+	extract_patchable_functions<Elf>(ehdr, names);
+    });
+    if (!ok)
+      return;
+
+    if (is_double) {
+      for (auto n = names.begin(); n != names.end(); n++) {
+	if (doubles[*n]++ == 0)
+	  changed_double(*n);
+      }
+      double_files[filename] = names;
+    } else {
+      for (auto n = names.begin(); n != names.end(); n++)
+	definers[*n].insert(filename);
+      objects[filename] = names;
+      pending.insert(filename);
+    }
+    seen[filename] = fingerprint(filename);
+  }
+
+  /*
+   * Drops a removed file from the index.
+   */
+  void forget(string& filename) {
+    seen.erase(filename);
+    pending.erase(filename);
+
+    auto d = double_files.find(filename);
+    if (d != double_files.end()) {
+      for (auto n = d->second.begin(); n != d->second.end(); n++) {
+	if (--doubles[*n] == 0) {
+	  doubles.erase(*n);
+	  changed_double(*n);
+	  restored.insert(*n);
+	}
+      }
+      double_files.erase(d);
+    }
+
+    auto o = objects.find(filename);
+    if (o != objects.end()) {
+      for (auto n = o->second.begin(); n != o->second.end(); n++) {
+	auto p = definers.find(*n);
+	if (p != definers.end() && p->second.erase(filename) && p->second.empty())
+	  definers.erase(p);
+      }
+      objects.erase(o);
+    }
+  }
+
+  // A function gained or lost its last test double
+  void changed_double(const string& name) {
+    auto p = definers.find(name);
+    if (p != definers.end())
+      pending.insert(p->second.begin(), p->second.end());
+  }
+
+  /*
+   * Patches the objects affected by this batch of events against the
+   * current test doubles.  Functions which lost their test double are
+   * only restored in objects where they were GLOBAL when scanned, so
+   * functions weak in the source stay WEAK.  Files which are already
+   * consistent are only read.
+   */
+  void patch_pending() {
+    vector<string> current;
+    for (auto p = doubles.begin(); p != doubles.end(); p++)
+      current.push_back(p->first);
+
+    SymbolRules double_rules(rules);
+    double_rules.add_test_doubles(current);
+
+    for (auto p = pending.begin(); p != pending.end(); p++) {
+      string filename = *p;
+
+      vector<string> removed;
+      auto& names = objects[filename];
+      for (auto n = names.begin(); n != names.end(); n++) {
+	if (restored.count(*n) && doubles.count(*n) == 0)
+	  removed.push_back(*n);
+      }
+
+      SymbolRules restore_rules(rules);
+      if (removed.size() > 0) {
+	restore_rules.add_restored_doubles(removed);
+	restore_rules.add_test_doubles(current);
+      }
+      SymbolRules& all_rules = removed.size() > 0 ? restore_rules : double_rules;
+
+      bool changes = false;
+      (void)dispatch_elf(filename, false, [&]<typename Elf>(typename Elf::Ehdr* ehdr, size_t) {
+	auto [symbuf, _] = get_string_buffers<Elf>(ehdr);
+	auto [symhdr, nsyms] = get_symbol_table<Elf>(ehdr);
+	for (int idx=0; idx < nsyms && !changes; idx++, symhdr++)
+	  changes = patch_file<Elf>(symhdr, symbuf, all_rules);
+      });
+      if (!changes)
+	continue;
+
+      vector<string> objfiles{filename};
+      if (patch_files(objfiles, all_rules))
+	LOG_INFO(filename << ": patched");
+      seen[filename] = fingerprint(filename);
+    }
+
+    pending.clear();
+    restored.clear();
+  }
+
+  int fd = -1;
+  SymbolRules& rules;
+  string& prefix_name;
+  string& section_name;
+  string empty_name;
+
+  map<int, string> watches;				// wd => directory
+  unordered_map<string, int> doubles;			// function => number of test doubles
+  map<string, vector<string>> double_files;		// test double => its functions
+  map<string, vector<string>> objects;			// object => its patchable functions
+  unordered_map<string, set<string>> definers;		// function => objects defining it
+  map<string, tuple<ino_t, off_t, time_t, long>> seen;	// file => fingerprint when processed
+  set<string> pending;					// objects to patch
+  set<string> restored;					// functions which lost their test double
+};
+
 int main(int argc, char** argv)
 {
   vector<string> dupfiles;	// contain replacement function definitions
   vector<string> infiles;	// unclassified input files
   vector<string> funclist;	// use unordered_set?
+  vector<string> manifests;	// files listing test double function names
+  string manifest_out;
+  SymbolRules rules;		// from --rules files
+  string plan_out;
+  string plan_in;
+  vector<string> watch_dirs;	// --watch directories
+  string files_from_name;	// more input files, '-' for stdin
+  int filter_fd = -1;		// --filter input
 
   string prefix_name("mock");
   string section_name(".mock");
 
   bool list_flag = false;
   bool write_flag = false;	// This is the point but require explicit request
+  bool compile_wrap_flag = false;
+
+  // long only options
+  enum {
+    OPT_MANIFEST = 256,
+    OPT_WRITE_MANIFEST,
+    OPT_COMPILE_WRAP,
+    OPT_STATE_FILE,
+    OPT_PLAN,
+    OPT_APPLY,
+    OPT_RULES,
+    OPT_WATCH,
+    OPT_FILES_FROM,
+    OPT_FILTER,
+  };
+
+  atexit(log_flush);
+
+  // Long file lists may come in response files rather than argv
+  vector<string> args(argv, argv + argc);
+  if (!expand_response_files(args))
+    exit(1);
+  vector<char*> arg_ptrs;
+  for (auto p = args.begin(); p != args.end(); p++)
+    arg_ptrs.push_back(p->data());
+  arg_ptrs.push_back(nullptr);
+  argc = args.size();
+  argv = arg_ptrs.data();
 
   int c;
   while (true) {
@@ -568,11 +2345,23 @@ int main(int argc, char** argv)
       {"prefix-name",      required_argument, 0, 'p'},
       {"write-flag",       no_argument,       0, 'w'},
       {"list",             no_argument      , 0, 'l'},
+      {"quiet",            no_argument      , 0, 'q'},
+      {"verbose",          no_argument      , 0, 'v'},
       {"help",             no_argument      , 0, 'h'},
+      {"manifest",         required_argument, 0, OPT_MANIFEST},
+      {"write-manifest",   required_argument, 0, OPT_WRITE_MANIFEST},
+      {"compile-wrap",     no_argument,       0, OPT_COMPILE_WRAP},
+      {"state-file",       required_argument, 0, OPT_STATE_FILE},
+      {"plan",             required_argument, 0, OPT_PLAN},
+      {"apply",            required_argument, 0, OPT_APPLY},
+      {"rules",            required_argument, 0, OPT_RULES},
+      {"watch",            required_argument, 0, OPT_WATCH},
+      {"files-from",       required_argument, 0, OPT_FILES_FROM},
+      {"filter",           optional_argument, 0, OPT_FILTER},
       {0,               0,                 0,  0 }
     };
 
-    c = getopt_long(argc, argv, "r:f:s:wlh", long_options, &option_index);
+    c = getopt_long(argc, argv, "r:f:s:p:wlqvh", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -589,6 +2378,12 @@ int main(int argc, char** argv)
     case 'w':
       write_flag = true;
       break;
+    case 'q':
+      log_level = LEVEL_ERROR;
+      break;
+    case 'v':
+      log_level = LEVEL_VERBOSE;
+      break;
     case 's':
       section_name = optarg;
       break;
@@ -599,6 +2394,53 @@ int main(int argc, char** argv)
       usage(argv[0]);
       return 0;
       break;
+    case OPT_MANIFEST:
+      manifests.push_back(optarg);
+      break;
+    case OPT_WRITE_MANIFEST:
+      manifest_out = optarg;
+      break;
+    case OPT_COMPILE_WRAP:
+      compile_wrap_flag = true;
+      break;
+    case OPT_PLAN:
+      plan_out = optarg;
+      patch_plan.enable();
+      write_flag = true;	// plan the writes
+      break;
+    case OPT_APPLY:
+      plan_in = optarg;
+      break;
+    case OPT_RULES:
+      {
+	string rules_file(optarg);
+	if (!rules.read(rules_file))
+	  exit(1);
+      }
+      break;
+    case OPT_FILES_FROM:
+      files_from_name = optarg;
+      break;
+    case OPT_FILTER:
+      filter_fd = STDIN_FILENO;
+      if (optarg) {
+	char* end;
+	errno = 0;
+	long fd = strtol(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || errno || fd < 0 || fd > INT_MAX) {
+	  LOG_ERROR("invalid file descriptor --filter=" << optarg);
+	  exit(1);
+	}
+	filter_fd = fd;
+      }
+      break;
+    case OPT_WATCH:
+      watch_dirs.push_back(optarg);
+      break;
+    case OPT_STATE_FILE:
+      if (!patch_state.open(optarg))
+	exit(1);
+      break;
     default:
       usage(argv[0]);
       return -1;
@@ -606,6 +2448,46 @@ int main(int argc, char** argv)
     }
   }
 
+  // these modes patch as they go and never save a plan
+  if (plan_out.size() > 0 && (compile_wrap_flag || watch_dirs.size() > 0 || filter_fd >= 0)) {
+    LOG_ERROR("--plan can't be combined with --compile-wrap, --watch or --filter");
+    exit(1);
+  }
+
+  if (plan_in.size() > 0) {
+    PatchPlan plan;
+    exit(plan.read(plan_in) && plan.apply() ? 0 : 1);
+  }
+
+  for (auto p = manifests.begin(); p != manifests.end(); p++) {
+    if (!read_manifest(*p, funclist))
+      exit(1);
+  }
+
+  /*
+   * Everything after '--' is the compiler command line.
+   */
+  if (compile_wrap_flag) {
+    vector<string> command(argv + optind, argv + argc);
+    init_tables();
+    exit(compile_wrap(command, dupfiles, funclist, rules, prefix_name, section_name));
+  }
+
+  if (filter_fd >= 0) {
+    if (optind < argc) {
+      LOG_ERROR("OBJFILES can't be given with --filter");
+      exit(1);
+    }
+    init_tables();
+    exit(filter_object(filter_fd, dupfiles, funclist, rules, section_name));
+  }
+
+  if (watch_dirs.size() > 0) {
+    init_tables();
+    Watcher watcher(dupfiles, funclist, rules, prefix_name, section_name);
+    exit(watcher.run(watch_dirs) ? 0 : 1);
+  }
+
   while (optind < argc) {
     string s = argv[optind];
     if (file_has_select_prefix(s, prefix_name))
@@ -615,29 +2497,33 @@ int main(int argc, char** argv)
     optind++;
   }
 
+  ifstream files_from_file;
+  istream* files_from = nullptr;
+  if (files_from_name == "-") {
+    files_from = &cin;
+  } else if (files_from_name.size() > 0) {
+    files_from_file.open(files_from_name);
+    if (!files_from_file) {
+      LOG_ERROR("unable to read file list " << files_from_name);
+      exit(1);
+    }
+    files_from = &files_from_file;
+  }
+
   init_tables();
 
-  /*
-   * Figure out if we have elf32 or elf64 files by checking the first
-   * one.
-   */
-  switch (check_arch(*(infiles.begin()))) {
-  case ELFCLASS32:
-    process_files<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym>(infiles, dupfiles, funclist, section_name, write_flag);
-    break;
-  case ELFCLASS64:
-    process_files<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym>(infiles, dupfiles, funclist, section_name, write_flag);
-    break;
-  case ELFCLASSNONE:
-  default:
+  int status = process_files(infiles, dupfiles, funclist, rules, prefix_name, section_name,
+			     write_flag, files_from) ? 0 : 1;
+
+  if (manifest_out.size() > 0 && !write_manifest(manifest_out, funclist))
+    exit(1);
+
+  if (plan_out.size() > 0 && !patch_plan.write(plan_out))
     exit(1);
-    break;
-  }
 
   if (list_flag) {
-    for_each(funclist.begin(), funclist.end(), [](auto p){ cout << p << endl; });
-    exit(0);
+    for_each(funclist.begin(), funclist.end(), [](auto p){ cout << p << '\n'; });
   }
 
-  exit(0);
+  exit(status);
 }
@@ -0,0 +1,11 @@
+/* No headers so the Elf32 objects build without a 32-bit C library */
+
+int mixed_func(void)
+{
+  return 1;
+}
+
+int mixed_other_func(void)
+{
+  return 2;
+}
@@ -0,0 +1,4 @@
+int mixed_func(void)
+{
+  return 42;
+}
@@ -0,0 +1,9 @@
+int mixed_func(void);
+int mixed_other_func(void);
+
+int main(int argc, char** argv)
+{
+  if (mixed_func() != 42 || mixed_other_func() != 2)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""
+End-to-end benchmark of the ways to link test doubles over existing
+object files.
+
+For every (N, M, K) in the size matrix this generates N object files
+of M functions each, a main calling all of them and a test double
+file replacing K of those functions, then times the whole "prepare
+and link" step for:
+
+  wrapper   cmake-link-wrapper.py running mk-weakfunc-elf -w then the link
+  native    mk-weakfunc-elf -w followed by the link
+  objcopy   objcopy --weaken-symbol on each object file then the link
+  wrap      a single link with -Wl,--wrap for each double (the doubles
+            are named __wrap_NAME)
+
+Each method starts from a fresh copy of the compiled objects and the
+resulting program is run to check the doubles were actually used.
+The best of --repeat runs is reported.  The benchmark fails if native
+is not faster than objcopy for every size, or, with --baseline, if
+native relative to objcopy or wrap grew by more than --max-ratio
+compared with that report.  Ratios from the same run don't depend on
+the speed of the machine.
+"""
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+DEFAULT_SIZES = "10x10x5,50x50x50,200x50x500"
+
+
+def func_name(i, j):
+    return "f_%d_%d" % (i, j)
+
+
+def generate(srcdir, nobjs, nfuncs, ndoubles):
+    """Writes the sources and returns the list of doubled functions."""
+    for i in range(nobjs):
+        with open(os.path.join(srcdir, "obj%d.c" % i), "w") as f:
+            for j in range(nfuncs):
+                f.write("int %s(void) { return 1; }\n" % func_name(i, j))
+
+    names = [func_name(i, j) for i in range(nobjs) for j in range(nfuncs)]
+    # spread the doubles evenly over all the objects
+    step = max(1, len(names) // max(1, ndoubles))
+    doubles = names[::step][:ndoubles]
+
+    with open(os.path.join(srcdir, "main.c"), "w") as f:
+        f.write("#include <stdio.h>\n")
+        for name in names:
+            f.write("int %s(void);\n" % name)
+        f.write("int main(void)\n{\n  int sum = 0;\n")
+        for name in names:
+            f.write("  sum += %s();\n" % name)
+        f.write('  printf("%d\\n", sum);\n  return 0;\n}\n')
+
+    with open(os.path.join(srcdir, "mock-doubles.c"), "w") as f:
+        for name in doubles:
+            f.write("int %s(void) { return 2; }\n" % name)
+
+    with open(os.path.join(srcdir, "wrap-doubles.c"), "w") as f:
+        for name in doubles:
+            f.write("int __wrap_%s(void) { return 2; }\n" % name)
+
+    return doubles
+
+
+# native is compared with these methods timed in the same run
+RATIOS = ["objcopy", "wrap"]
+
+
+def ratios(times):
+    return {m: times["native"] / times[m] for m in RATIOS}
+
+
+def read_report(path):
+    """Returns the native time ratios of a report by (N, M, K)."""
+    result = {}
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if not fields or not fields[0].isdigit():
+                continue
+            key = tuple(int(x) for x in fields[:3])
+            times = {m: float(t.rstrip("ms")) for m, t in zip(METHODS, fields[3:])}
+            result[key] = ratios(times)
+    return result
+
+
+def compile_all(cc, srcdir, objdir):
+    sources = [s for s in os.listdir(srcdir) if s.endswith(".c")]
+    procs = [subprocess.Popen([cc, "-c", "-O0", os.path.join(srcdir, s),
+                               "-o", os.path.join(objdir, s[:-2] + ".o")])
+             for s in sources]
+    if any(p.wait() != 0 for p in procs):
+        sys.exit("error: compile failed")
+
+
+def run(cmd, cwd, env=None):
+    subprocess.run(cmd, cwd=cwd, env=env, check=True,
+                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+class Methods:
+    def __init__(self, args, nobjs, doubles):
+        self.args = args
+        self.objs = ["main.o"] + ["obj%d.o" % i for i in range(nobjs)]
+        self.doubles = doubles
+        self.env = dict(os.environ)
+        self.env["PATH"] = os.path.dirname(os.path.abspath(args.tool)) + \
+            os.pathsep + self.env["PATH"]
+
+    def link_cmd(self, objs):
+        return [self.args.cc] + objs + ["-o", "prog"]
+
+    def wrapper(self, workdir):
+        objs = self.objs + ["mock-doubles.o"]
+        run([self.args.wrapper] + self.link_cmd(objs), workdir, self.env)
+
+    def native(self, workdir):
+        objs = self.objs + ["mock-doubles.o"]
+        run([self.args.tool, "-q", "-w"] + objs, workdir)
+        run(self.link_cmd(objs), workdir)
+
+    def objcopy(self, workdir):
+        weaken = ["--weaken-symbol=" + name for name in self.doubles]
+        for obj in self.objs:
+            run([self.args.objcopy] + weaken + [obj], workdir)
+        run(self.link_cmd(self.objs + ["mock-doubles.o"]), workdir)
+
+    def wrap(self, workdir):
+        wrap = ["-Wl,--wrap=" + name for name in self.doubles]
+        run(self.link_cmd(self.objs + ["wrap-doubles.o"]) + wrap, workdir)
+
+
+METHODS = ["wrapper", "native", "objcopy", "wrap"]
+
+
+def time_method(method, objdir, workdir, expected):
+    shutil.rmtree(workdir, ignore_errors=True)
+    shutil.copytree(objdir, workdir)
+
+    start = time.perf_counter()
+    method(workdir)
+    elapsed = time.perf_counter() - start
+
+    out = subprocess.run(["./prog"], cwd=workdir, check=True,
+                         capture_output=True, text=True).stdout
+    if int(out) != expected:
+        sys.exit("error: %s linked the wrong functions" % method.__name__)
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--tool", default="mk-weakfunc-elf")
+    parser.add_argument("--wrapper", default="cmake-link-wrapper.py")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument("--objcopy", default="objcopy")
+    parser.add_argument("--sizes", default=DEFAULT_SIZES,
+                        help="comma separated NxMxK list (default %(default)s)")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--report", default="bench-report.txt")
+    parser.add_argument("--baseline",
+                        help="earlier report to compare the native times with")
+    parser.add_argument("--max-ratio", type=float, default=2.0,
+                        help="allowed growth of the native ratios against --baseline "
+                        "(default %(default)s)")
+    args = parser.parse_args()
+    baseline = read_report(args.baseline) if args.baseline else {}
+
+    # the methods run in their own work directories
+    for tool in ("tool", "wrapper"):
+        path = getattr(args, tool)
+        if os.sep in path:
+            setattr(args, tool, os.path.abspath(path))
+
+    lines = ["%6s %6s %6s  %s" % ("N", "M", "K",
+                                 " ".join("%11s" % m for m in METHODS))]
+    failures = []
+    with tempfile.TemporaryDirectory(prefix="mk-weakfunc-bench.") as tmp:
+        for size in args.sizes.split(","):
+            nobjs, nfuncs, ndoubles = (int(x) for x in size.split("x"))
+            srcdir = os.path.join(tmp, "src-" + size)
+            objdir = os.path.join(tmp, "obj-" + size)
+            os.makedirs(srcdir)
+            os.makedirs(objdir)
+            doubles = generate(srcdir, nobjs, nfuncs, ndoubles)
+            compile_all(args.cc, srcdir, objdir)
+
+            methods = Methods(args, nobjs, doubles)
+            expected = nobjs * nfuncs + len(doubles)
+            best = {}
+            for name in METHODS:
+                workdir = os.path.join(tmp, "work")
+                best[name] = min(
+                    time_method(getattr(methods, name), objdir, workdir, expected)
+                    for _ in range(args.repeat))
+
+            lines.append("%6d %6d %6d  %s" % (
+                nobjs, nfuncs, len(doubles),
+                " ".join("%9.1fms" % (best[m] * 1000) for m in METHODS)))
+            print(lines[-1], flush=True)
+
+            if best["native"] >= best["objcopy"]:
+                failures.append("%s: native is not faster than objcopy" % size)
+            key = (nobjs, nfuncs, len(doubles))
+            for m, ratio in ratios(best).items():
+                if key in baseline and ratio > baseline[key][m] * args.max_ratio:
+                    failures.append("%s: native/%s %.2f is over %g times the baseline %.2f" % (
+                        size, m, ratio, args.max_ratio, baseline[key][m]))
+
+    with open(args.report, "w") as f:
+        f.write("# prepare and link times, best of %d\n" % args.repeat)
+        f.write("\n".join(lines) + "\n")
+    print("report written to " + args.report)
+
+    if failures:
+        sys.exit("error: " + "\nerror: ".join(failures))
+
+
+if __name__ == "__main__":
+    main()
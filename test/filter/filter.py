@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Checks --filter: an object file read from a pipe, a regular file or an
+inherited file descriptor is weakened on stdout and the input is left
+alone.  A .mock labeled test double comes out unchanged and invalid
+file descriptors are rejected.
+
+The test sources are the ones of test/C: test-multi-func.c calling a
+function which mock-func.c replaces and func-section.c labels.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--tool", default="mk-weakfunc-elf")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument("--readelf", default="readelf")
+    parser.add_argument("--sources", required=True,
+                        help="directory holding the test/C sources")
+    args = parser.parse_args()
+
+    # everything runs in a work directory
+    tool = os.path.abspath(args.tool) if os.sep in args.tool else args.tool
+    srcdir = os.path.abspath(args.sources)
+
+    def compile(source, *flags):
+        subprocess.run([args.cc, "-c", *flags, os.path.join(srcdir, source),
+                        "-o", source[:-2] + ".o"], cwd=workdir, check=True)
+
+    def path(name):
+        return os.path.join(workdir, name)
+
+    def prelink(*options, **kwargs):
+        return subprocess.run([tool, *options], cwd=workdir, capture_output=True, **kwargs)
+
+    def binding(obj, name):
+        out = subprocess.run([args.readelf, "-sW", obj], cwd=workdir,
+                             check=True, capture_output=True, text=True).stdout
+        for f in (line.split() for line in out.splitlines()):
+            if len(f) == 8 and f[7] == name:
+                return f[4]
+        return None
+
+    with tempfile.TemporaryDirectory(prefix="mk-weakfunc-filter.") as workdir:
+        for source in ("test-multi-func.c", "func.c", "mock-func.c"):
+            compile(source)
+        compile("func-section.c", "-DCUSTOM_SECTION=.mock")
+        original = read(path("func.o"))
+
+        # a pipe goes through a memfd
+        piped = prelink("--filter", "-f", "func", input=original)
+        if piped.returncode != 0:
+            sys.exit("error: --filter from a pipe failed:\n" + piped.stderr.decode())
+        with open(path("func-weak.o"), "wb") as f:
+            f.write(piped.stdout)
+        if binding("func-weak.o", "func") != "WEAK" or \
+           binding("func-weak.o", "not_mocked_func") != "GLOBAL":
+            sys.exit("error: --filter did not weaken just func")
+
+        # a regular file is mapped copy-on-write
+        with open(path("func.o")) as f:
+            regular = prelink("--filter", "-f", "func", stdin=f)
+        if regular.returncode != 0 or regular.stdout != piped.stdout:
+            sys.exit("error: --filter from a regular file differs from a pipe")
+        if read(path("func.o")) != original:
+            sys.exit("error: --filter modified its input file")
+
+        fd = os.open(path("func.o"), os.O_RDONLY)
+        inherited = prelink("--filter=%d" % fd, "-f", "func", pass_fds=[fd],
+                            stdin=subprocess.DEVNULL)
+        os.close(fd)
+        if inherited.returncode != 0 or inherited.stdout != piped.stdout:
+            sys.exit("error: --filter=FD differs from stdin")
+
+        subprocess.run([args.cc, "test-multi-func.o", "func-weak.o", "mock-func.o",
+                        "-o", "prog"], cwd=workdir, check=True)
+        out = subprocess.run(["./prog"], cwd=workdir, check=True,
+                             capture_output=True, text=True).stdout
+        if "mock-func.c:func" not in out:
+            sys.exit("error: the test double was not linked:\n" + out)
+
+        # labeled test doubles are never weakened
+        labeled = read(path("func-section.o"))
+        result = prelink("--filter", "-f", "func", input=labeled)
+        if result.returncode != 0 or result.stdout != labeled:
+            sys.exit("error: --filter changed a labeled test double")
+
+        for fd in ("foo", "-1", ""):
+            if prelink("--filter=" + fd, input=original).returncode == 0:
+                sys.exit("error: --filter=%s was accepted" % fd)
+
+    print("filter ok")
+
+
+if __name__ == "__main__":
+    main()
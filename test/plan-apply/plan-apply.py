@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""
+Checks that --plan leaves the object files alone, --apply makes the
+planned changes, applying twice is harmless and a rebuilt object file
+is not modified.
+
+The test sources are the ones of test/C: test-multi-func.c calling a
+function which mock-func.c replaces.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def snapshot(workdir, objs):
+    return {obj: read(os.path.join(workdir, obj)) for obj in objs}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--tool", default="mk-weakfunc-elf")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument("--sources", required=True,
+                        help="directory holding the test/C sources")
+    args = parser.parse_args()
+
+    # everything runs in a work directory
+    tool = os.path.abspath(args.tool) if os.sep in args.tool else args.tool
+    srcdir = os.path.abspath(args.sources)
+
+    sources = ["test-multi-func.c", "func.c", "mock-func.c"]
+    objs = [s[:-2] + ".o" for s in sources]
+
+    def compile(source, *flags):
+        subprocess.run([args.cc, "-c", *flags, os.path.join(srcdir, source),
+                        "-o", source[:-2] + ".o"], cwd=workdir, check=True)
+
+    def prelink(*options):
+        return subprocess.run([tool, *options], cwd=workdir).returncode
+
+    with tempfile.TemporaryDirectory(prefix="mk-weakfunc-plan.") as workdir:
+        for source in sources:
+            compile(source)
+
+        before = snapshot(workdir, objs)
+        if prelink("--plan=weak.plan", *objs) != 0:
+            sys.exit("error: --plan failed")
+        if snapshot(workdir, objs) != before:
+            sys.exit("error: --plan modified the object files")
+
+        if prelink("--apply=weak.plan") != 0:
+            sys.exit("error: --apply failed")
+        applied = snapshot(workdir, objs)
+        if applied == before:
+            sys.exit("error: --apply changed nothing")
+
+        subprocess.run([args.cc, *objs, "-o", "prog"], cwd=workdir, check=True)
+        out = subprocess.run(["./prog"], cwd=workdir, check=True,
+                             capture_output=True, text=True).stdout
+        if "mock-func.c:func" not in out:
+            sys.exit("error: the test double was not linked:\n" + out)
+
+        if prelink("--apply=weak.plan") != 0:
+            sys.exit("error: applying the plan twice failed")
+        if snapshot(workdir, objs) != applied:
+            sys.exit("error: applying the plan twice changed the object files")
+
+        # a rebuilt object no longer matches the plan
+        compile("func.c", "-O1")
+        rebuilt = read(os.path.join(workdir, "func.o"))
+        if prelink("-q", "--apply=weak.plan") == 0:
+            sys.exit("error: --apply accepted a rebuilt object file")
+        if read(os.path.join(workdir, "func.o")) != rebuilt:
+            sys.exit("error: --apply modified a rebuilt object file")
+
+        # modes which patch as they go can't save a plan
+        if prelink("--plan=wrap.plan", "-f", "func", "--compile-wrap", "--",
+                   args.cc, "-c", os.path.join(srcdir, "func.c")) == 0:
+            sys.exit("error: --plan was accepted with --compile-wrap")
+
+    print("plan and apply ok")
+
+
+if __name__ == "__main__":
+    main()
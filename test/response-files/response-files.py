@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""
+Checks the expansion of @FILE response files: quoted and backslash
+escaped paths with spaces, nested response files, the nesting limit
+and that arguments after '--' reach the --compile-wrap command
+unexpanded.
+
+The test sources are the ones of test/C: test-multi-func.c calling a
+function which mock-func.c replaces.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--tool", default="mk-weakfunc-elf")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument("--sources", required=True,
+                        help="directory holding the test/C sources")
+    args = parser.parse_args()
+
+    # everything runs in a work directory
+    tool = os.path.abspath(args.tool) if os.sep in args.tool else args.tool
+    srcdir = os.path.abspath(args.sources)
+
+    objs = {"test-multi-func.c": "test-multi-func.o",
+            "func.c": "obj dir/func.o",
+            "mock-func.c": "mock dir/mock-func.o"}
+
+    def write(name, text):
+        with open(os.path.join(workdir, name), "w") as f:
+            f.write(text)
+
+    def prelink(*options):
+        return subprocess.run([tool, *options], cwd=workdir,
+                              capture_output=True, text=True)
+
+    with tempfile.TemporaryDirectory(prefix="mk-weakfunc-rsp.") as workdir:
+        for source, obj in objs.items():
+            os.makedirs(os.path.join(workdir, os.path.dirname(obj) or "."), exist_ok=True)
+            subprocess.run([args.cc, "-c", os.path.join(srcdir, source), "-o", obj],
+                           cwd=workdir, check=True)
+
+        write("args.rsp", '-w "obj dir/func.o"\n@nested.rsp\n')
+        write("nested.rsp", "mock\\ dir/mock-func.o 'test-multi-func.o'\n")
+        result = prelink("@args.rsp")
+        if result.returncode != 0:
+            sys.exit("error: response files failed:\n" + result.stderr)
+
+        subprocess.run([args.cc, *objs.values(), "-o", "prog"], cwd=workdir, check=True)
+        out = subprocess.run(["./prog"], cwd=workdir, check=True,
+                             capture_output=True, text=True).stdout
+        if "mock-func.c:func" not in out:
+            sys.exit("error: the test double was not linked:\n" + out)
+
+        # a response file naming itself
+        write("loop.rsp", "@loop.rsp\n")
+        result = prelink("@loop.rsp")
+        if result.returncode == 0 or "nested too deeply" not in result.stderr:
+            sys.exit("error: a recursive response file was accepted:\n" + result.stderr)
+
+        # the compiler expands its own response files
+        write("cc.rsp", "not for mk-weakfunc-elf\n")
+        command = ["sh", "-c", 'echo "$1" > seen', "sh", "@cc.rsp"]
+        write("wrap.rsp", "--compile-wrap -- " + " ".join(
+            "'%s'" % arg for arg in command) + "\n")
+        seen_path = os.path.join(workdir, "seen")
+        for options in (["--compile-wrap", "--", *command], ["@wrap.rsp"]):
+            if os.path.exists(seen_path):
+                os.remove(seen_path)
+            result = prelink(*options)
+            seen = open(seen_path).read().strip()
+            if result.returncode != 0 or seen != "@cc.rsp":
+                sys.exit("error: %s: the compiler got %r:\n%s" % (
+                    " ".join(options), seen, result.stderr))
+
+    print("response files ok")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,8 @@
+#include <stdio.h>
+
+/* Test doubles are never weakened but the rules still apply */
+__attribute__((noinline, used)) static int mock_counter(void)
+{
+  printf("%s:%s\n", __FILE__, __func__);
+  return 7;
+}
@@ -0,0 +1,18 @@
+#include <stdio.h>
+
+__attribute__((noinline, used)) static int lib_counter(void)
+{
+  printf("%s:%s\n", __FILE__, __func__);
+  return 40;
+}
+
+int lib_internal(void)
+{
+  printf("%s:%s\n", __FILE__, __func__);
+  return 2;
+}
+
+int lib_entry(void)
+{
+  return lib_counter() + lib_internal();
+}
@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+int lib_counter(void);
+int mock_counter(void);
+int lib_entry(void);
+
+int lib_internal(void)
+{
+  printf("%s:%s\n", __FILE__, __func__);
+  return 100;
+}
+
+int main(int argc, char** argv)
+{
+  printf("%s\n", argv[0]);
+
+  if (lib_entry() != 42 || lib_counter() != 40 || lib_internal() != 100 ||
+      mock_counter() != 7)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+"""
+Checks that concurrent invocations sharing a --state-file patch each
+object file exactly once and that an object rebuilt after it was
+recorded is patched again.
+
+The test sources are the ones of test/C: func.c defines a function
+which mock-func.c replaces.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--tool", default="mk-weakfunc-elf")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument("--sources", required=True,
+                        help="directory holding the test/C sources")
+    parser.add_argument("--jobs", type=int, default=8)
+    args = parser.parse_args()
+
+    # everything runs in a work directory
+    tool = os.path.abspath(args.tool) if os.sep in args.tool else args.tool
+    srcdir = os.path.abspath(args.sources)
+
+    sources = ["test-multi-func.c", "func.c", "mock-func.c"]
+    objs = [s[:-2] + ".o" for s in sources]
+    patched = [obj for obj in objs if not obj.startswith("mock")]
+
+    def compile(source):
+        subprocess.run([args.cc, "-c", os.path.join(srcdir, source),
+                        "-o", source[:-2] + ".o"], cwd=workdir, check=True)
+
+    def prelink(jobs):
+        procs = [subprocess.Popen([tool, "-v", "-w", "--state-file=patched.state"] + objs,
+                                  cwd=workdir, stderr=subprocess.PIPE, text=True)
+                 for _ in range(jobs)]
+        logs = [p.communicate()[1] for p in procs]
+        if any(p.returncode != 0 for p in procs):
+            sys.exit("error: mk-weakfunc-elf failed:\n" + "".join(logs))
+        return "".join(logs).splitlines()
+
+    def count(lines, text):
+        return sum(1 for line in lines if line == text)
+
+    with tempfile.TemporaryDirectory(prefix="mk-weakfunc-state.") as workdir:
+        for source in sources:
+            compile(source)
+
+        lines = prelink(args.jobs)
+        if count(lines, "func.o: func GLOBAL => WEAK") != 1:
+            sys.exit("error: func.o was not weakened exactly once:\n" + "\n".join(lines))
+        for obj in patched:
+            skipped = count(lines, obj + ": already patched")
+            if skipped != args.jobs - 1:
+                sys.exit("error: %s was patched %d times" % (obj, args.jobs - skipped))
+
+        # same inode and size, only the mtime differs
+        compile("func.c")
+        lines = prelink(1)
+        if count(lines, "func.o: func GLOBAL => WEAK") != 1:
+            sys.exit("error: rebuilt func.o was not patched again:\n" + "\n".join(lines))
+        if count(lines, "test-multi-func.o: already patched") != 1:
+            sys.exit("error: unchanged test-multi-func.o was patched again")
+
+    print("state file ok")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,9 @@
+int watch_weak(void)
+{
+  return 10;
+}
+
+int watch_func(void)
+{
+  return 20;
+}
@@ -0,0 +1,14 @@
+__attribute__((weak)) int watch_weak(void)
+{
+  return 1;
+}
+
+int watch_func(void)
+{
+  return 2;
+}
+
+int watch_other_func(void)
+{
+  return 3;
+}
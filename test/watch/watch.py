@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""
+Checks that --watch patches object files as they are written to the
+watched directory.
+
+watch-lib.c defines watch_func, watch_other_func and the weak
+watch_weak.  mock-watch.c replaces watch_func and watch_weak.  Adding
+the test double weakens watch_func.  A rebuilt watch-lib.o is weakened
+again.  Removing the test double turns watch_func back to GLOBAL but
+leaves watch_weak WEAK, as it is in the source.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+TIMEOUT = 10
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--tool", default="mk-weakfunc-elf")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument("--readelf", default="readelf")
+    args = parser.parse_args()
+
+    # everything runs in a work directory
+    tool = os.path.abspath(args.tool) if os.sep in args.tool else args.tool
+    srcdir = os.path.dirname(os.path.abspath(__file__))
+
+    def compile(source):
+        subprocess.run([args.cc, "-c", os.path.join(srcdir, source),
+                        "-o", os.path.join("obj", source[:-2] + ".o")],
+                       cwd=workdir, check=True)
+
+    def bindings():
+        out = subprocess.run([args.readelf, "-sW", "obj/watch-lib.o"], cwd=workdir,
+                             check=True, capture_output=True, text=True).stdout
+        return {f[7]: f[4] for f in (line.split() for line in out.splitlines())
+                if len(f) == 8 and f[7].startswith("watch_")}
+
+    def wait_for(expected, what):
+        deadline = time.monotonic() + TIMEOUT
+        while time.monotonic() < deadline:
+            current = bindings()
+            if all(current.get(k) == v for k, v in expected.items()):
+                return current
+            time.sleep(0.05)
+        sys.exit("error: %s: expected %s, got %s" % (what, expected, current))
+
+    with tempfile.TemporaryDirectory(prefix="mk-weakfunc-watch.") as workdir:
+        os.mkdir(os.path.join(workdir, "obj"))
+        compile("watch-lib.c")
+
+        log_path = os.path.join(workdir, "watch.log")
+        with open(log_path, "w") as log:
+            watcher = subprocess.Popen([tool, "-v", "--watch=obj"], cwd=workdir,
+                                       stderr=log)
+        try:
+            deadline = time.monotonic() + TIMEOUT
+            while "watching" not in open(log_path).read():
+                if time.monotonic() > deadline or watcher.poll() is not None:
+                    sys.exit("error: the watcher did not start")
+                time.sleep(0.05)
+
+            compile("mock-watch.c")
+            wait_for({"watch_func": "WEAK", "watch_weak": "WEAK",
+                      "watch_other_func": "GLOBAL"}, "test double added")
+
+            compile("watch-lib.c")
+            wait_for({"watch_func": "WEAK", "watch_weak": "WEAK",
+                      "watch_other_func": "GLOBAL"}, "object rebuilt")
+
+            os.remove(os.path.join(workdir, "obj", "mock-watch.o"))
+            wait_for({"watch_func": "GLOBAL", "watch_weak": "WEAK",
+                      "watch_other_func": "GLOBAL"}, "test double removed")
+        finally:
+            watcher.terminate()
+            watcher.wait()
+            sys.stderr.write(open(log_path).read())
+
+    print("watch ok")
+
+
+if __name__ == "__main__":
+    main()